@@ -0,0 +1,399 @@
+/**
+ * @file   banco.c
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Banco de preguntas mapeado a memoria, con indice por id, categorias y sorteo sin repeticion
+ * reemplaza a pregunta.sh y respuesta.sh: en vez de un cat|grep|cut por cada pregunta y otro
+ * por cada respuesta, el archivo de texto se recorre una sola vez al arrancar. El binario que arma
+ * bancoc ya trae las tablas y se usa directo desde el mapeo, sin recorrerlo.
+ * @see repo del curso en GIT
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include "banco.h"
+
+#define BANCO_MAX_ID  (1u << 24)   ///< tope de id, acota la memoria del indice
+
+/** @brief Tablas que se arman al leer un archivo de texto, las mismas que trae el binario */
+struct banco_armado {
+  struct banco_entrada *entradas;      ///< en el orden del archivo, al final se agrupan por categoria
+  unsigned int nEntradas, lugarEntradas;
+  struct banco_categoria *categorias;
+  unsigned int nCategorias, lugarCategorias;
+  uint32_t *indice;                    ///< por id, posicion en entradas + 1
+  unsigned int ids;                    ///< lugar del indice
+  unsigned int maxId;                  ///< id maximo + 1
+  unsigned int ultima;                 ///< categoria de la linea anterior
+};
+
+/** @brief Se asegura de que un arreglo tenga lugar para n elementos, lo nuevo queda en cero
+ *  crece al doble para que armar las tablas siga siendo lineal en el tamanio del archivo
+ */
+static int banco_crecer(void **v, unsigned int *lugar, unsigned int n, size_t tam){
+  unsigned int l = *lugar ? *lugar : 1024;
+  void *nuevo;
+
+  if (n <= *lugar)
+    return 0;
+  while (l < n)
+    l *= 2;
+  nuevo = realloc(*v, (size_t)l * tam);
+  if (nuevo == NULL)
+    return -ENOMEM;
+  memset((char *)nuevo + (size_t)*lugar * tam, 0, (size_t)(l - *lugar) * tam);
+  *v = nuevo;
+  *lugar = l;
+  return 0;
+}
+
+/** @brief Nro de la categoria con ese nombre, la agrega si es nueva
+ *  los bancos suelen venir agrupados por tema, asi que casi siempre es la de la linea anterior; si no,
+ *  se busca entre todas (son pocas)
+ */
+static int banco_categoria_de(struct banco_armado *a, const struct banco *b, const char *nombre, unsigned int largo){
+  struct banco_categoria *c;
+  unsigned int i;
+
+  for (i = 0; i <= a->nCategorias; i++){
+    unsigned int k = i == 0 ? a->ultima : i - 1;
+
+    if (k >= a->nCategorias)
+      continue;
+    c = &a->categorias[k];
+    if (c->largoNombre == largo && memcmp(b->datos + c->nombre, nombre, largo) == 0)
+      return a->ultima = k;
+  }
+  if (banco_crecer((void **)&a->categorias, &a->lugarCategorias, a->nCategorias + 1, sizeof(*c)))
+    return -ENOMEM;
+  c = &a->categorias[a->nCategorias];
+  c->nombre      = nombre - b->datos;
+  c->largoNombre = largo;
+  return a->ultima = a->nCategorias++;
+}
+
+/** @brief Indexa una linea "id:pregunta:respuesta[:categoria]", las que no tienen ese formato se ignoran
+ *  igual que con cut, la respuesta termina en el siguiente ':' o en el fin de linea
+ */
+static int banco_linea(struct banco_armado *a, const struct banco *b, const char *linea, const char *fin){
+  const char *p = linea, *preg, *resp, *dos, *cat, *finCat;
+  unsigned int id = 0;
+  struct banco_entrada *e;
+  int c;
+
+  if (fin > linea && fin[-1] == '\r')     // archivos editados en windows
+    fin--;
+  if (p == fin || *p < '0' || *p > '9')
+    return 0;
+  while (p < fin && *p >= '0' && *p <= '9'){
+    id = id * 10 + (*p++ - '0');
+    if (id >= BANCO_MAX_ID)
+      return 0;
+  }
+  if (p == fin || *p != ':')
+    return 0;
+  preg = p + 1;
+  dos = memchr(preg, ':', fin - preg);
+  if (dos == NULL)
+    return 0;
+  resp = dos + 1;
+  p = memchr(resp, ':', fin - resp);
+  cat = finCat = fin;                     // sin cuarto campo la pregunta queda sin categoria
+  if (p != NULL){
+    cat = p + 1;
+    finCat = memchr(cat, ':', fin - cat);
+    if (finCat == NULL)
+      finCat = fin;
+    fin = p;
+  }
+
+  if (id < a->ids && a->indice[id])       // id repetido, vale el primero
+    return 0;
+  if (id >= a->ids && banco_crecer((void **)&a->indice, &a->ids, id + 1, sizeof(*a->indice)))
+    return -ENOMEM;
+  if (banco_crecer((void **)&a->entradas, &a->lugarEntradas, a->nEntradas + 1, sizeof(*e)))
+    return -ENOMEM;
+  c = banco_categoria_de(a, b, cat, finCat - cat);
+  if (c < 0)
+    return c;
+  a->categorias[c].cantidad++;
+  e = &a->entradas[a->nEntradas++];
+  e->id             = id;
+  e->categoria      = c;
+  e->pregunta       = preg - b->datos;
+  e->largoPregunta  = dos - preg;
+  e->respuesta      = resp - b->datos;
+  e->largoRespuesta = fin - resp;
+  a->indice[id]     = a->nEntradas;
+  if (id >= a->maxId)
+    a->maxId = id + 1;
+  return 0;
+}
+
+/** @brief Agrupa las entradas por categoria (conteo, lineal y estable) y rehace el indice por id
+ *  cada categoria queda como un tramo contiguo, que es lo que sortea banco_sortear
+ */
+static int banco_agrupar(struct banco_armado *a){
+  struct banco_entrada *agrupadas;
+  uint32_t *lugar, i, n = 0;
+
+  agrupadas = malloc((a->nEntradas ? a->nEntradas : 1) * sizeof(*agrupadas));
+  lugar = malloc((a->nCategorias ? a->nCategorias : 1) * sizeof(*lugar));
+  if (agrupadas == NULL || lugar == NULL){
+    free(agrupadas);
+    free(lugar);
+    return -ENOMEM;
+  }
+  for (i = 0; i < a->nCategorias; i++){
+    a->categorias[i].primera = lugar[i] = n;
+    n += a->categorias[i].cantidad;
+  }
+  for (i = 0; i < a->nEntradas; i++){
+    n = lugar[a->entradas[i].categoria]++;
+    agrupadas[n] = a->entradas[i];
+    a->indice[agrupadas[n].id] = n + 1;
+  }
+  free(lugar);
+  free(a->entradas);
+  a->entradas = agrupadas;
+  return 0;
+}
+
+/** @brief Recorre el archivo de texto una vez y arma las tablas en memoria */
+static int banco_texto(struct banco *b){
+  struct banco_armado a = { 0 };
+  const char *p, *fin, *nl;
+  int err = 0;
+
+  madvise((void *)b->datos, b->largo, MADV_SEQUENTIAL);   // se recorre una vez de punta a punta
+  for (p = b->datos, fin = b->datos + b->largo; p < fin && !err; p = nl + 1){
+    nl = memchr(p, '\n', fin - p);
+    if (nl == NULL)
+      nl = fin;                           // ultima linea sin '\n'
+    err = banco_linea(&a, b, p, nl);
+  }
+  if (!err)
+    err = banco_agrupar(&a);
+  b->entradas    = a.entradas;
+  b->categorias  = a.categorias;
+  b->indice      = a.indice;
+  b->ids         = a.maxId;
+  b->cantidad    = a.nEntradas;
+  b->nCategorias = a.nCategorias;
+  madvise((void *)b->datos, b->largo, MADV_RANDOM);       // de aca en mas se accede por id
+  return err;
+}
+
+/** @brief La seccion de n elementos de tam bytes en off esta dentro del archivo y alineada */
+static int banco_seccion(const struct banco *b, uint32_t off, uint32_t n, size_t tam){
+  return off % sizeof(uint32_t) == 0 && off + (uint64_t)n * tam <= b->largo;
+}
+
+/** @brief Usa las tablas del binario directo desde el mapeo
+ *  se revisan la cabecera y las categorias, que son pocas; las entradas se revisan al usarlas, asi
+ *  abrir un banco de millones de preguntas no lee mas que la primera pagina
+ */
+static int banco_binario(struct banco *b){
+  const struct banco_cabecera *c = (const struct banco_cabecera *)b->datos;
+  const struct banco_categoria *cat;
+  uint32_t i, n = 0;
+
+  if (b->largo < sizeof(*c))
+    return -EINVAL;
+  if (c->version != BANCO_VERSION)
+    return -EPROTO;
+  if (!banco_seccion(b, c->offCategorias, c->categorias, sizeof(*cat)) ||
+      !banco_seccion(b, c->offEntradas, c->cantidad, sizeof(struct banco_entrada)) ||
+      !banco_seccion(b, c->offIndice, c->ids, sizeof(uint32_t)) ||
+      (uint64_t)c->offArena + c->largoArena > b->largo)
+    return -EINVAL;
+  cat = (const struct banco_categoria *)(b->datos + c->offCategorias);
+  for (i = 0; i < c->categorias; i++){   // n <= c->cantidad siempre, la resta no da la vuelta
+    if (cat[i].primera != n || cat[i].cantidad > c->cantidad - n ||
+        (uint64_t)cat[i].nombre + cat[i].largoNombre > b->largo)
+      return -EINVAL;
+    n += cat[i].cantidad;
+  }
+  if (n != c->cantidad)
+    return -EINVAL;
+  b->entradas    = (const struct banco_entrada *)(b->datos + c->offEntradas);
+  b->categorias  = cat;
+  b->indice      = (const uint32_t *)(b->datos + c->offIndice);
+  b->ids         = c->ids;
+  b->cantidad    = c->cantidad;
+  b->nCategorias = c->categorias;
+  b->binario     = 1;
+  madvise((void *)b->datos, b->largo, MADV_RANDOM);       // solo se leen las paginas de lo que se sortea
+  return 0;
+}
+
+/** @brief Mapea el archivo de preguntas, de texto o binario, y deja listas las tablas
+ *  @return 0 si esta OK, o -errno
+ */
+int banco_abrir(struct banco *b, const char *ruta){
+  struct stat st;
+  int fd, err = 0;
+
+  memset(b, 0, sizeof(*b));
+  fd = open(ruta, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  if (fstat(fd, &st) < 0){
+    err = -errno;
+    close(fd);
+    return err;
+  }
+  if (st.st_size == 0 || (unsigned long long)st.st_size > UINT32_MAX){
+    err = st.st_size == 0 ? -ENODATA : -EFBIG;
+    close(fd);
+    return err;
+  }
+  b->largo = st.st_size;
+  b->datos = mmap(NULL, b->largo, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);                              // el mapeo sigue valido sin el descriptor
+  if (b->datos == MAP_FAILED){
+    b->datos = NULL;
+    return -errno;
+  }
+  if (b->largo >= sizeof(BANCO_MAGIA) - 1 && memcmp(b->datos, BANCO_MAGIA, sizeof(BANCO_MAGIA) - 1) == 0)
+    err = banco_binario(b);
+  else
+    err = banco_texto(b);
+  if (err)
+    banco_cerrar(b);
+  return err;
+}
+
+void banco_cerrar(struct banco *b){
+  if (b->datos)
+    munmap((void *)b->datos, b->largo);
+  if (!b->binario){                       // las tablas del texto son propias
+    free((void *)b->entradas);
+    free((void *)b->categorias);
+    free((void *)b->indice);
+  }
+  memset(b, 0, sizeof(*b));
+}
+
+/** @brief Los textos de la entrada estan dentro del archivo (las del binario se revisan recien aca) */
+static int banco_valida(const struct banco *b, const struct banco_entrada *e){
+  return !b->binario || ((uint64_t)e->pregunta + e->largoPregunta <= b->largo &&
+                         (uint64_t)e->respuesta + e->largoRespuesta <= b->largo);
+}
+
+/** @brief Busca una pregunta por id
+ *  @return la entrada con los offsets de pregunta y respuesta, o NULL si no existe
+ */
+const struct banco_entrada *banco_buscar(const struct banco *b, unsigned int id){
+  const struct banco_entrada *e;
+
+  if (id >= b->ids || b->indice[id] == 0 || b->indice[id] > b->cantidad)
+    return NULL;
+  e = &b->entradas[b->indice[id] - 1];
+  return banco_valida(b, e) ? e : NULL;
+}
+
+/** @brief Busca una categoria por nombre
+ *  @return su nro, o -1 si no existe
+ */
+int banco_categoria(const struct banco *b, const char *nombre){
+  size_t largo = strlen(nombre);
+  unsigned int i;
+
+  for (i = 0; i < b->nCategorias; i++)
+    if (b->categorias[i].largoNombre == largo && memcmp(b->datos + b->categorias[i].nombre, nombre, largo) == 0)
+      return i;
+  return -1;
+}
+
+/** @brief Pide al kernel que traiga a memoria las paginas de una entrada
+ *  se llama con la pregunta siguiente mientras se juega la actual, asi mostrarla no espera a la
+ *  tarjeta SD; madvise no bloquea, la lectura sigue en segundo plano
+ */
+void banco_precargar(const struct banco *b, const struct banco_entrada *e){
+  long pagina = sysconf(_SC_PAGESIZE);
+  uintptr_t desde = (uintptr_t)(b->datos + e->pregunta) & ~(pagina - 1);
+  uintptr_t hasta = (uintptr_t)(b->datos + e->respuesta + e->largoRespuesta);
+
+  madvise((void *)desde, hasta - desde, MADV_WILLNEED);
+}
+
+/** @brief splitmix64, para las claves de cada vuelta del sorteo */
+static uint64_t banco_azar(uint64_t *x){
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void banco_vuelta(struct banco_sorteo *s){
+  unsigned int r;
+
+  for (r = 0; r < 4; r++)
+    s->claves[r] = banco_azar(&s->estado);
+  s->sacadas = 0;
+}
+
+/** @brief Permutacion de [0, 2^(2*bits)): red de Feistel de 4 vueltas, biyectiva con cualquier clave */
+static uint32_t banco_feistel(const struct banco_sorteo *s, uint32_t x){
+  uint32_t mascara = (1u << s->bits) - 1, izq = x >> s->bits, der = x & mascara, h, r;
+
+  for (r = 0; r < 4; r++){
+    h = (der ^ s->claves[r]) * 0x9e3779b1u;
+    h ^= h >> 15;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h = izq ^ (h & mascara);
+    izq = der;
+    der = h;
+  }
+  return izq << s->bits | der;
+}
+
+/** @brief Prepara un sorteo sobre una categoria, o sobre todo el banco si categoria < 0 */
+void banco_sorteo_iniciar(struct banco_sorteo *s, const struct banco *b, int categoria, uint64_t semilla){
+  memset(s, 0, sizeof(*s));
+  if (categoria >= 0 && (unsigned int)categoria < b->nCategorias){
+    s->primera  = b->categorias[categoria].primera;
+    s->cantidad = b->categorias[categoria].cantidad;
+  } else {
+    s->cantidad = b->cantidad;
+  }
+  s->bits = 1;
+  while ((1ULL << (2 * s->bits)) < s->cantidad)
+    s->bits++;
+  s->estado = semilla;
+  banco_vuelta(s);
+}
+
+/** @brief Pregunta siguiente del sorteo: no se repite ninguna hasta que salieron todas las del tramo
+ *  la red permuta un rango de a lo sumo 4 veces el tramo; si cae afuera se vuelve a aplicar (cycle
+ *  walking), que sigue siendo una permutacion del tramo y en promedio son menos de 4 pasadas
+ *  @return la entrada, o NULL si el tramo esta vacio
+ */
+const struct banco_entrada *banco_sortear(struct banco_sorteo *s, const struct banco *b){
+  const struct banco_entrada *e;
+  uint32_t x, vistas;
+
+  for (vistas = 0; vistas < s->cantidad; vistas++){   // las entradas rotas de un binario se saltean
+    if (s->sacadas == s->cantidad)
+      banco_vuelta(s);
+    x = s->sacadas++;
+    do
+      x = banco_feistel(s, x);
+    while (x >= s->cantidad);
+    e = &b->entradas[s->primera + x];
+    if (banco_valida(b, e))
+      return e;
+  }
+  return NULL;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file   banco.h
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Banco de preguntas del juego de trivia
+ * se abre de dos formas, siempre con un solo mmap del archivo:
+ *   texto:   una pregunta por linea, "id:pregunta:respuesta[:categoria]"; se recorre una vez al arrancar
+ *            y se arman en memoria las mismas tablas que trae el binario
+ *   binario: el que genera bancoc a partir del texto (ver abajo); las tablas ya vienen hechas y abrirlo
+ *            no depende de la cantidad de preguntas
+ * en los dos casos cada pregunta y su respuesta salen en O(1) por id, y banco_sortear las reparte al
+ * azar sin repetir, de todo el banco o de una sola categoria
+ * @see repo del curso en GIT
+ */
+
+#ifndef BANCO_H
+#define BANCO_H
+
+#include<stddef.h>
+#include<stdint.h>
+
+/* Formato binario, version 1 (enteros en el orden de bytes de la maquina, la BeagleBone y la PC
+ * donde se compila son little endian):
+ *
+ *   banco_cabecera
+ *   banco_categoria[categorias]     una por categoria, ordenadas como aparecen en el texto
+ *   banco_entrada[cantidad]         agrupadas por categoria: cada categoria es un tramo contiguo
+ *   uint32_t[ids]                   indice por id: posicion en las entradas + 1, 0 si el id no existe
+ *   arena                           los textos en UTF-8 tal cual venian, sin separadores
+ *
+ * todos los offsets (secciones, textos) se cuentan desde el principio del archivo, asi las entradas
+ * se usan directo desde el mapeo, igual que las que se arman sobre el archivo de texto
+ */
+#define BANCO_MAGIA   "TRIVBANC"   ///< 8 bytes al principio del binario
+#define BANCO_VERSION 1
+
+/** @brief Cabecera del binario */
+struct banco_cabecera {
+  char     magia[8];      ///< BANCO_MAGIA
+  uint32_t version;       ///< BANCO_VERSION
+  uint32_t cantidad;      ///< entradas
+  uint32_t categorias;    ///< categorias
+  uint32_t ids;           ///< largo del indice (id maximo + 1)
+  uint32_t offCategorias; ///< offset de la tabla de categorias
+  uint32_t offEntradas;   ///< offset de la tabla de entradas
+  uint32_t offIndice;     ///< offset del indice por id
+  uint32_t offArena;      ///< offset de los textos
+  uint32_t largoArena;    ///< largo de los textos en bytes
+  uint32_t reservado;     ///< 0
+};
+
+/** @brief Una pregunta: donde estan la pregunta y la respuesta dentro del archivo mapeado */
+struct banco_entrada {
+  uint32_t id;            ///< id de la pregunta en el archivo de texto
+  uint32_t categoria;     ///< nro de categoria
+  uint32_t pregunta;      ///< offset de la pregunta
+  uint32_t largoPregunta; ///< largo de la pregunta en bytes
+  uint32_t respuesta;     ///< offset de la respuesta
+  uint32_t largoRespuesta;///< largo de la respuesta en bytes
+};
+
+/** @brief Una categoria, el tramo de entradas que le corresponde */
+struct banco_categoria {
+  uint32_t nombre;        ///< offset del nombre
+  uint32_t largoNombre;   ///< largo del nombre, 0 para las preguntas sin categoria
+  uint32_t primera;       ///< posicion de su primera entrada
+  uint32_t cantidad;      ///< entradas de la categoria
+};
+
+/** @brief Banco abierto */
+struct banco {
+  const char *datos;                         ///< archivo mapeado con mmap, solo lectura
+  size_t largo;                              ///< largo del archivo
+  const struct banco_entrada *entradas;      ///< cantidad entradas, agrupadas por categoria
+  const struct banco_categoria *categorias;  ///< nCategorias categorias
+  const uint32_t *indice;                    ///< indexado por id, posicion en entradas + 1
+  unsigned int ids;                          ///< largo del indice (id maximo + 1)
+  unsigned int cantidad;                     ///< preguntas cargadas
+  unsigned int nCategorias;
+  int binario;                               ///< las tablas son del mapeo, si no estan en memoria propia
+};
+
+/** @brief Sorteo sin repeticion sobre un tramo de entradas
+ *  recorre una permutacion al azar del tramo sin guardarla: la posicion i de la vuelta sale de una red
+ *  de Feistel con claves propias de la vuelta. Cada pregunta sale una vez por vuelta, cada sorteo es O(1)
+ *  y no ocupa memoria aunque el banco tenga millones de preguntas. Al terminar la vuelta se sortean
+ *  claves nuevas.
+ */
+struct banco_sorteo {
+  uint32_t primera;       ///< primera entrada del tramo
+  uint32_t cantidad;      ///< entradas del tramo
+  uint32_t sacadas;       ///< sacadas en esta vuelta
+  uint32_t bits;          ///< bits de cada mitad de la red, 2^(2*bits) >= cantidad
+  uint32_t claves[4];     ///< una por vuelta de la red
+  uint64_t estado;        ///< generador de las claves
+};
+
+int  banco_abrir(struct banco *b, const char *ruta);
+void banco_cerrar(struct banco *b);
+const struct banco_entrada *banco_buscar(const struct banco *b, unsigned int id);
+int  banco_categoria(const struct banco *b, const char *nombre);
+void banco_precargar(const struct banco *b, const struct banco_entrada *e);
+void banco_sorteo_iniciar(struct banco_sorteo *s, const struct banco *b, int categoria, uint64_t semilla);
+const struct banco_entrada *banco_sortear(struct banco_sorteo *s, const struct banco *b);
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * @file   bancoc.c
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Compilador del banco de preguntas: pasa el archivo de texto al formato binario de banco.h
+ * lee el texto con banco_abrir (las mismas reglas que usa el juego) y escribe cabecera, categorias,
+ * entradas agrupadas por categoria, indice por id y los textos juntos en una arena, copiados byte a byte
+ * (el UTF-8 queda igual; si alguno no es UTF-8 valido solo se avisa). La pregunta y su respuesta quedan
+ * pegadas en la arena, asi precargar una entrada trae una sola pagina casi siempre.
+ * El archivo se escribe aparte y se renombra al final: un juego que tenga mapeado el anterior sigue
+ * andando con el viejo.
+ * uso: bancoc <preguntas.txt> <preguntas.bin>
+ * @see repo del curso en GIT
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+
+#include "banco.h"
+
+/** @brief Secuencia UTF-8 bien formada (sin sobrelargos ni surrogates) */
+static int utf8_valido(const unsigned char *s, uint32_t n){
+  static const uint32_t minimo[4] = { 0, 0x80, 0x800, 0x10000 };  // menor cp de cada largo
+  uint32_t i = 0, k, j, cp;
+
+  while (i < n){
+    if (s[i] < 0x80){
+      i++;
+      continue;
+    }
+    if (s[i] >= 0xc2 && s[i] <= 0xdf)
+      k = 1, cp = s[i] & 0x1f;
+    else if (s[i] >= 0xe0 && s[i] <= 0xef)
+      k = 2, cp = s[i] & 0x0f;
+    else if (s[i] >= 0xf0 && s[i] <= 0xf4)
+      k = 3, cp = s[i] & 0x07;
+    else
+      return 0;
+    if (n - i <= k)
+      return 0;
+    for (j = 1; j <= k; j++){
+      if ((s[i + j] & 0xc0) != 0x80)
+        return 0;
+      cp = cp << 6 | (s[i + j] & 0x3f);
+    }
+    if (cp < minimo[k] || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+      return 0;
+    i += k + 1;
+  }
+  return 1;
+}
+
+/** @brief Escribe n bytes, y si falla lo recuerda para el final */
+static void escribir(FILE *f, const void *p, size_t n, int *err){
+  if (n && fwrite(p, n, 1, f) != 1)
+    *err = -errno;
+}
+
+int main(int argc, char *argv[]){
+  struct banco b;
+  struct banco_cabecera cab = { .version = BANCO_VERSION };
+  struct banco_categoria *cats;
+  struct banco_entrada *ents;
+  uint64_t off, arena;
+  uint32_t i, invalidas = 0, primeraInvalida = 0;
+  char temporal[4096];
+  FILE *f;
+  int err;
+
+  if (argc != 3){
+    fprintf(stderr, "uso: %s <preguntas.txt> <preguntas.bin>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  err = banco_abrir(&b, argv[1]);
+  if (err < 0){
+    fprintf(stderr, "Falla al cargar las preguntas de %s: %s\n", argv[1], strerror(-err));
+    return -err;
+  }
+  cats = malloc((b.nCategorias ? b.nCategorias : 1) * sizeof(*cats));
+  ents = malloc((b.cantidad ? b.cantidad : 1) * sizeof(*ents));
+  if (cats == NULL || ents == NULL){
+    fprintf(stderr, "Sin memoria para %u preguntas\n", b.cantidad);
+    return ENOMEM;
+  }
+
+  // secciones en orden, todas de elementos de 4 bytes alineados
+  memcpy(cab.magia, BANCO_MAGIA, sizeof(cab.magia));
+  cab.cantidad      = b.cantidad;
+  cab.categorias    = b.nCategorias;
+  cab.ids           = b.ids;
+  cab.offCategorias = sizeof(cab);
+  cab.offEntradas   = cab.offCategorias + b.nCategorias * sizeof(*cats);
+  off               = cab.offEntradas + (uint64_t)b.cantidad * sizeof(*ents);
+  cab.offIndice     = off;
+  off              += (uint64_t)b.ids * sizeof(uint32_t);
+  cab.offArena      = off;
+
+  // los textos se acomodan en la arena: primero los nombres de las categorias, despues cada pregunta
+  // seguida de su respuesta
+  arena = off;
+  for (i = 0; i < b.nCategorias; i++){
+    cats[i] = b.categorias[i];
+    cats[i].nombre = arena;
+    arena += cats[i].largoNombre;
+  }
+  for (i = 0; i < b.cantidad; i++){
+    const struct banco_entrada *e = &b.entradas[i];
+
+    if (!utf8_valido((const unsigned char *)b.datos + e->pregunta, e->largoPregunta) ||
+        !utf8_valido((const unsigned char *)b.datos + e->respuesta, e->largoRespuesta)){
+      if (!invalidas++)
+        primeraInvalida = e->id;
+    }
+    ents[i] = *e;
+    ents[i].pregunta = arena;
+    arena += e->largoPregunta;
+    ents[i].respuesta = arena;
+    arena += e->largoRespuesta;
+  }
+  if (arena > UINT32_MAX){                  // los offsets son de 32 bits
+    fprintf(stderr, "El banco no entra en 4 GB\n");
+    return EFBIG;
+  }
+  cab.largoArena = arena - off;
+
+  snprintf(temporal, sizeof(temporal), "%s.tmp", argv[2]);
+  f = fopen(temporal, "wb");
+  if (f == NULL){
+    perror(temporal);
+    return errno;
+  }
+  err = 0;
+  escribir(f, &cab, sizeof(cab), &err);
+  escribir(f, cats, b.nCategorias * sizeof(*cats), &err);
+  escribir(f, ents, (size_t)b.cantidad * sizeof(*ents), &err);
+  escribir(f, b.indice, (size_t)b.ids * sizeof(uint32_t), &err);
+  for (i = 0; i < b.nCategorias; i++)
+    escribir(f, b.datos + b.categorias[i].nombre, b.categorias[i].largoNombre, &err);
+  for (i = 0; i < b.cantidad; i++){
+    escribir(f, b.datos + b.entradas[i].pregunta, b.entradas[i].largoPregunta, &err);
+    escribir(f, b.datos + b.entradas[i].respuesta, b.entradas[i].largoRespuesta, &err);
+  }
+  if (fclose(f) != 0 && !err)
+    err = -errno;
+  if (err || rename(temporal, argv[2]) < 0){
+    fprintf(stderr, "Falla al escribir %s: %s\n", argv[2], strerror(err ? -err : errno));
+    remove(temporal);
+    return EXIT_FAILURE;
+  }
+
+  printf("%s: %u preguntas, %u categorias, %u bytes de texto, %llu bytes en total\n", argv[2],
+         b.cantidad, b.nCategorias, cab.largoArena, (unsigned long long)arena);
+  for (i = 0; i < b.nCategorias; i++)
+    printf("  %-24.*s %u\n", b.categorias[i].largoNombre ? (int)b.categorias[i].largoNombre : 16,
+           b.categorias[i].largoNombre ? b.datos + b.categorias[i].nombre : "(sin categoria)",
+           b.categorias[i].cantidad);
+  if (invalidas)
+    fprintf(stderr, "Aviso: %u preguntas no son UTF-8 valido (la primera, id %u), se copiaron igual\n",
+            invalidas, primeraInvalida);
+  free(cats);
+  free(ents);
+  banco_cerrar(&b);
+  return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file   bancoprueba.c
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Prueba de banco_abrir con binarios rotos a proposito
+ * arma en un archivo temporal un binario chico y correcto (dos categorias, 16 preguntas) y despues
+ * variantes con la tabla de categorias mal hecha: cantidades que sumadas dan la vuelta en 32 bits,
+ * tramos corridos, de mas o de menos y nombres fuera del archivo. El correcto tiene que abrir y
+ * sortear solo entradas de su tramo; los rotos no tienen que abrir.
+ * uso: bancoprueba
+ * @see repo del curso en GIT
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+
+#include "banco.h"
+
+#define PREGUNTAS 16
+#define MITAD     (PREGUNTAS / 2)
+
+/** @brief Un binario completo: secciones en el mismo orden que las escribe bancoc */
+struct binario {
+  struct banco_cabecera cab;
+  struct banco_categoria cats[2];
+  struct banco_entrada ents[PREGUNTAS];
+  uint32_t indice[PREGUNTAS];
+  char arena[2 + 2 * PREGUNTAS];   ///< "ab" de nombres, despues "p" y "r" de cada pregunta
+};
+
+/** @brief Arma el binario correcto: la categoria "a" con las primeras MITAD preguntas y "b" con el resto */
+static void armar(struct binario *x){
+  uint32_t i, arena = offsetof(struct binario, arena);
+
+  memset(x, 0, sizeof(*x));
+  memcpy(x->cab.magia, BANCO_MAGIA, sizeof(x->cab.magia));
+  x->cab.version       = BANCO_VERSION;
+  x->cab.cantidad      = PREGUNTAS;
+  x->cab.categorias    = 2;
+  x->cab.ids           = PREGUNTAS;
+  x->cab.offCategorias = offsetof(struct binario, cats);
+  x->cab.offEntradas   = offsetof(struct binario, ents);
+  x->cab.offIndice     = offsetof(struct binario, indice);
+  x->cab.offArena      = arena;
+  x->cab.largoArena    = sizeof(x->arena);
+  for (i = 0; i < 2; i++){
+    x->cats[i].nombre      = arena + i;
+    x->cats[i].largoNombre = 1;
+    x->cats[i].primera     = i * MITAD;
+    x->cats[i].cantidad    = MITAD;
+    x->arena[i]            = 'a' + i;
+  }
+  for (i = 0; i < PREGUNTAS; i++){
+    x->ents[i].id             = i;
+    x->ents[i].categoria      = i / MITAD;
+    x->ents[i].pregunta       = arena + 2 + 2 * i;
+    x->ents[i].largoPregunta  = 1;
+    x->ents[i].respuesta      = arena + 3 + 2 * i;
+    x->ents[i].largoRespuesta = 1;
+    x->indice[i]              = i + 1;
+    x->arena[2 + 2 * i]       = 'p';
+    x->arena[3 + 2 * i]       = 'r';
+  }
+}
+
+/** @brief Escribe el binario en ruta y lo abre con banco_abrir
+ *  @return lo que devuelve banco_abrir; si abrio, el banco queda abierto en b
+ */
+static int abrir(const char *ruta, const struct binario *x, struct banco *b){
+  FILE *f = fopen(ruta, "wb");
+
+  if (f == NULL || fwrite(x, sizeof(*x), 1, f) != 1 || fclose(f) != 0){
+    perror(ruta);
+    exit(EXIT_FAILURE);
+  }
+  return banco_abrir(b, ruta);
+}
+
+/** @brief Un binario roto tiene que dar -EINVAL
+ *  @return 1 si abrio o dio otro error
+ */
+static unsigned int roto(const char *ruta, const struct binario *x, const char *que){
+  struct banco b;
+  int err = abrir(ruta, x, &b);
+
+  if (err == 0)
+    banco_cerrar(&b);
+  if (err == -EINVAL)
+    return 0;
+  fprintf(stderr, "bancoprueba: %s: banco_abrir devolvio %d en vez de %d\n", que, err, -EINVAL);
+  return 1;
+}
+
+int main(void){
+  char ruta[] = "/tmp/bancopruebaXXXXXX";
+  struct binario x;
+  struct banco b;
+  struct banco_sorteo s;
+  const struct banco_entrada *e;
+  unsigned int errores = 0, i, c;
+  int fd, err;
+
+  fd = mkstemp(ruta);
+  if (fd < 0){
+    perror(ruta);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  // el correcto abre, y cada categoria sortea solo de su tramo
+  armar(&x);
+  err = abrir(ruta, &x, &b);
+  if (err){
+    fprintf(stderr, "bancoprueba: el binario correcto no abre: %s\n", strerror(-err));
+    errores++;
+  } else {
+    for (c = 0; c < 2; c++){
+      banco_sorteo_iniciar(&s, &b, c, 1);
+      for (i = 0; i < 2 * MITAD; i++){
+        e = banco_sortear(&s, &b);
+        if (e == NULL || e < b.entradas + c * MITAD || e >= b.entradas + (c + 1) * MITAD || e->categoria != c){
+          fprintf(stderr, "bancoprueba: el sorteo de la categoria %u salio de su tramo\n", c);
+          errores++;
+          break;
+        }
+      }
+    }
+    banco_cerrar(&b);
+  }
+
+  // cantidades que suman bien en 32 bits dando la vuelta: 0xfffffff0 + 0x20 = 0x10
+  armar(&x);
+  x.cats[0].cantidad = 0xfffffff0u;
+  x.cats[1].primera  = 0xfffffff0u;
+  x.cats[1].cantidad = 0x20;
+  errores += roto(ruta, &x, "cantidades que dan la vuelta");
+
+  armar(&x);
+  x.cats[0].cantidad = PREGUNTAS + 1;     // la primera sola ya se pasa del total
+  x.cats[1].primera  = PREGUNTAS + 1;
+  x.cats[1].cantidad = 0xffffffffu;
+  errores += roto(ruta, &x, "categoria mas larga que el banco");
+
+  armar(&x);
+  x.cats[1].cantidad = MITAD - 1;         // falta una
+  errores += roto(ruta, &x, "categorias que no cubren el banco");
+
+  armar(&x);
+  x.cats[1].primera = MITAD + 1;          // tramo corrido
+  errores += roto(ruta, &x, "tramo que no sigue al anterior");
+
+  armar(&x);
+  x.cats[1].nombre = sizeof(x);           // el nombre empieza al final del archivo
+  errores += roto(ruta, &x, "nombre fuera del archivo");
+
+  armar(&x);
+  x.cab.categorias = 0x10000000;          // la tabla no entra en el archivo
+  errores += roto(ruta, &x, "tabla de categorias fuera del archivo");
+
+  remove(ruta);
+  printf("bancoprueba: %u errores\n", errores);
+  return errores ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Banco de pruebas del driver sin BeagleBone: los botones y leds son lineas de gpio-sim
+# arma un chip simulado con 4 lineas por jugador (botones, rojos, verdes, azules, en ese orden),
+# carga trivialkm.ko sobre esas lineas y corre triviabench, que deja el resultado en JSON
+# uso (como root, con make all bench hecho): ./bench.sh [jugadores] [opciones de triviabench] > resultado.json
+
+set -e
+J=${1:-2}
+[ $# -gt 0 ] && shift
+CFG=/sys/kernel/config/gpio-sim/trivia
+
+limpiar() {
+  rmmod trivialkm 2>/dev/null || true
+  if [ -d $CFG ]; then
+    echo 0 > $CFG/live 2>/dev/null || true
+    rmdir $CFG/bank0/line* 2>/dev/null || true
+    rmdir $CFG/bank0 $CFG
+  fi
+}
+trap limpiar EXIT
+
+modprobe gpio-sim
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+mkdir $CFG $CFG/bank0
+echo $((4 * J)) > $CFG/bank0/num_lines
+echo trivia > $CFG/bank0/label
+echo 1 > $CFG/live
+
+# el driver usa nros de GPIO globales, la base del chip sale de la clase gpio
+BASE=
+for c in /sys/class/gpio/gpiochip*; do
+  [ "$(cat $c/label)" = trivia ] && BASE=$(cat $c/base)
+done
+[ -n "$BASE" ] || { echo "no se encontro el chip simulado en /sys/class/gpio" >&2; exit 1; }
+
+lista() {   # lista N desde: N nros seguidos separados por coma
+  seq -s, $2 $(($2 + $1 - 1))
+}
+insmod ./trivialkm.ko antirrebote_us=0 eventos=4096 \
+  botones=$(lista $J $BASE) rojos=$(lista $J $((BASE + J))) \
+  verdes=$(lista $J $((BASE + 2 * J))) azules=$(lista $J $((BASE + 3 * J)))
+
+./triviabench -s /sys/devices/platform/$(cat $CFG/dev_name)/$(cat $CFG/bank0/chip_name) -j $J "$@"
@@ -1,13 +1,21 @@
 /**
  * @file   trivia.c
- * @author Juan A. Montenegro	
+ * @author Juan A. Montenegro
  * @date   26 Oct 2016
  * @version 0.1
  * @brief   Programa de usuario del Diver LKM para BeagelBone Black que utiliza dos pulsadores y dos leds
  * conectados a ports GPIO e implementa un juego de preguntas y respuestas
- * el archivo con las preguntas y sus respuestas se carga del filesystem
- * mediante un shell script para imprimir la pregunta y luego otro para la respuesta
- * se llaman pregunta.sh y respuesta.sh respectivamente
+ * el archivo con las preguntas y sus respuestas se mapea a memoria una sola vez al arrancar
+ * (ver banco.c), de texto o compilado con bancoc, y las preguntas salen sorteadas sin repetir hasta
+ * que se usaron todas, sin lanzar procesos
+ * uso: trivia [archivo de preguntas] [rondas] [dispositivo] [log] [categoria], por defecto preguntas.txt,
+ * una ronda, la mesa /dev/trivialkm0, trivia.log y todas las categorias; rondas 0 juega sin fin. Cada mesa
+ * del driver es un juego aparte, con otro dispositivo corre otro juego a la vez.
+ * Es un servidor de un solo proceso: el driver arma las rondas solo (modo sesion, REVELAR_MS despues del
+ * resultado de la anterior) y el programa espera con epoll, todo junto, los eventos del anillo mapeado,
+ * los comandos por stdin, el vigilante de la ronda (timerfd) y las senales de fin. Mientras se juega una
+ * ronda ya tiene elegida y precargada la pregunta siguiente, y cada evento queda en un log binario.
+ * comandos: ENTER arranca o sigue, p pausa, +N suma rondas, e estado, q sale
  * @see repo del curso en SVN
  */
 
@@ -15,53 +23,418 @@
 #include<stdlib.h>
 #include<errno.h>
 #include<fcntl.h>
+#include<signal.h>
 #include<string.h>
 #include<time.h>
+#include<unistd.h>
+#include<sys/epoll.h>
+#include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<sys/signalfd.h>
+#include<sys/timerfd.h>
 
-int main (void){
-  
-  int fdlkm, fdtrv; //para el device y para el archivo con las preguntas
-  int r;
-  unsigned char s;
-  char buffer[256];
-  char comando[256];
-  
-  fdlkm = open ("/dev/trivialkm", O_RDWR);             // abrimos para lectura/escritura
-  if (fdlkm < 0){
+#include "trivialkm.h"   // formato del registro del anillo e ioctls
+#include "banco.h"       // banco de preguntas mapeado
+
+#define REVELAR_MS  5000     // tiempo para leer la respuesta antes de la ronda siguiente
+#define PLAZO_MS    30000    // tiempo para apretar; si vence se muestra la respuesta y se sigue
+#define GUARDIA_MS  2000     // el vigilante pregunta por el resultado si no llego este tiempo despues del plazo
+#define COLA        4        // rondas que se le dan por adelantado al driver, se repone de a una
+#define LOG_MAX     256      // registros del log que se juntan antes de escribir
+
+// festejo del ganador: el driver hace destellar su verde dos segundos y vuelve solo a los leds de la ronda
+static const struct trivia_animar festejo = { .patron = TRIVIA_ANIM_GANADOR, .periodo_ms = 1000, .ciclos = 2 };
+
+// tipos propios del log, ademas de los TRIVIA_EV_* del driver
+#define LOG_INICIO        0  ///< arranque del programa: t_ns CLOCK_MONOTONIC, dato = hora (time()) en s
+#define LOG_SIN_RESULTADO 15 ///< ronda que se cerro sin ver su resultado (anillo desbordado)
+
+/** @brief Registro del log binario, 16 bytes por evento en orden de llegada, sin cabecera
+ *  Cada corrida agrega un LOG_INICIO y despues los eventos. En los TRIVIA_EV_ARMADA el dato es el
+ *  id de la pregunta, en las presiones y vencimientos el delta_ns del evento en us.
+ */
+struct trivia_registro {
+  __u64 t_ns;        ///< t_ns del evento (CLOCK_MONOTONIC)
+  __u32 dato;        ///< segun el tipo, ver arriba
+  __u16 ronda;       ///< nro de ronda
+  __u8  tipo;        ///< TRIVIA_EV_* o LOG_*, con los TRIVIA_EVF_* en los 4 bits altos
+  __u8  jugador;     ///< nro de jugador, 0 si no es una presion
+};
+
+/** @brief Estado del servidor */
+struct juego {
+  int fdlkm, fdtimer, fdlog;
+  struct trivia_anillo *anillo;      ///< anillo de eventos del driver, mapeado: se consume sin read()
+  size_t largoAnillo;
+  __u32 desbordes;                   ///< ultimo valor visto de anillo->desbordes
+  const struct banco *banco;
+  struct banco_sorteo sorteo;        ///< preguntas que faltan salir en esta vuelta
+  const struct banco_entrada *actual;    ///< pregunta de la ronda en juego
+  const struct banco_entrada *proxima;   ///< la de la ronda siguiente, ya precargada
+  unsigned int rondas;               ///< rondas a jugar, 0 sin fin
+  unsigned int jugadas;              ///< rondas con resultado (o perdidas)
+  unsigned int porEncolar;           ///< rondas que todavia no se le pasaron al driver
+  unsigned int encoladas;            ///< pasadas al driver y todavia sin armar
+  unsigned int viva;                 ///< nro de la ronda armada sin resultado, 0 ninguna
+  int activo;                        ///< la sesion del driver esta corriendo
+  int salir;
+  struct trivia_registro log[LOG_MAX];
+  unsigned int nLog;
+};
+
+/** @brief Pregunta siguiente, al azar entre las que todavia no salieron */
+static const struct banco_entrada *elegir(struct juego *j){
+  return banco_sortear(&j->sorteo, j->banco);
+}
+
+static unsigned int id_de(const struct banco_entrada *e){
+  return e ? e->id : 0;
+}
+
+static void log_vaciar(struct juego *j){
+  if (j->nLog && j->fdlog >= 0 && write(j->fdlog, j->log, j->nLog * sizeof(j->log[0])) < 0)
+    perror("Falla al escribir el log");
+  j->nLog = 0;
+}
+
+static void log_poner(struct juego *j, unsigned int tipo, unsigned int ronda, unsigned int jugador, __u64 t_ns, __u32 dato){
+  struct trivia_registro *r = &j->log[j->nLog++];
+
+  r->t_ns    = t_ns;
+  r->dato    = dato;
+  r->ronda   = ronda;
+  r->tipo    = tipo;
+  r->jugador = jugador;
+  if (j->nLog == LOG_MAX)
+    log_vaciar(j);
+}
+
+static __u64 ahora_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);    // el mismo reloj que ktime_get_ns() en el driver
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief Programa el vigilante de la ronda, 0 lo desarma */
+static void vigilar(struct juego *j, unsigned int ms){
+  struct itimerspec it = { .it_value = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000L } };
+
+  timerfd_settime(j->fdtimer, 0, &it, NULL);
+}
+
+/** @brief Le pasa rondas al driver hasta tener COLA encoladas, o arranca la sesion si no estaba */
+static int encolar(struct juego *j){
+  struct trivia_sesion se = { .activa = 1, .revelar_ms = REVELAR_MS, .plazo_ms = PLAZO_MS };
+  __u32 n = COLA - j->encoladas, pedido;
+
+  if (j->encoladas >= COLA)
+    return 0;
+  if (j->rondas && n > j->porEncolar)
+    n = j->porEncolar;
+  if (n == 0)
+    return 0;
+  pedido = n;                                // ENCOLAR lo pisa con el total pendiente del driver
+  if (!j->activo){
+    se.rondas = n;
+    if (ioctl(j->fdlkm, TRIVIA_IOC_SESION, &se) < 0)
+      return -errno;
+    j->activo = 1;
+  } else if (ioctl(j->fdlkm, TRIVIA_IOC_ENCOLAR, &pedido) < 0){
+    return -errno;
+  }
+  j->encoladas += n;
+  if (j->rondas)
+    j->porEncolar -= n;
+  return 0;
+}
+
+/** @brief Pausa: termina la sesion del driver, la ronda en juego sigue hasta su resultado */
+static void pausar(struct juego *j){
+  struct trivia_sesion se = { .activa = 0 };
+
+  if (!j->activo)
+    return;
+  ioctl(j->fdlkm, TRIVIA_IOC_SESION, &se);  // el driver vacia su cola
+  j->activo = 0;
+  if (j->rondas)
+    j->porEncolar += j->encoladas;
+  j->encoladas = 0;
+}
+
+/** @brief Resultado de la ronda viva: ganador, vencimiento, o perdido si llego otra ronda antes */
+static void resultado(struct juego *j, const struct trivia_evento *ev){
+  const struct banco_entrada *e = j->actual;
+
+  if (ev->tipo == TRIVIA_EV_GANADOR){
+    printf("Primero se presiono: Boton%u (reaccion %llu.%03llu ms)\n", ev->jugador,
+           (unsigned long long)ev->delta_ns / 1000000, (unsigned long long)ev->delta_ns / 1000 % 1000);
+    ioctl(j->fdlkm, TRIVIA_IOC_ANIMAR, &festejo);   //si falla quedan los leds de la ronda, no es grave
+  } else if (ev->tipo == TRIVIA_EV_VENCIDA){
+    printf("Nadie respondio a tiempo\n");
+  } else {
+    printf("No se vio el resultado de la ronda %u\n", j->viva);
+  }
+  //la respuesta queda a la vista hasta que el driver arma la ronda siguiente
+  if (e)
+    printf("Respuesta: %.*s\n", (int)e->largoRespuesta, j->banco->datos + e->respuesta);
+  fflush(stdout);
+  j->viva = 0;
+  j->jugadas++;
+  vigilar(j, 0);
+  log_vaciar(j);                             // entre ronda y ronda hay tiempo de sobra para escribir
+  if (j->rondas && j->jugadas >= j->rondas)
+    j->salir = 1;
+}
+
+/** @brief Un evento del anillo */
+static void evento(struct juego *j, const struct trivia_evento *ev){
+  __u32 dato = ev->delta_ns / 1000;
+
+  if (ev->tipo == TRIVIA_EV_ARMADA){
+    if (j->viva){                            // el resultado de la anterior se perdio en un desborde
+      log_poner(j, LOG_SIN_RESULTADO, j->viva, 0, ev->t_ns, 0);
+      resultado(j, ev);
+      if (j->salir)
+        return;
+    }
+    // la pregunta ya estaba elegida y en memoria; la siguiente se elige y se precarga ahora
+    j->actual = j->proxima;
+    j->proxima = elegir(j);
+    if (j->proxima)
+      banco_precargar(j->banco, j->proxima);
+    dato = id_de(j->actual);
+    j->viva = ev->ronda;
+    if (j->encoladas)
+      j->encoladas--;
+    printf("\nRonda %u: %.*s\n", ev->ronda, j->actual ? (int)j->actual->largoPregunta : 0, j->actual ? j->banco->datos + j->actual->pregunta : "");
+    fflush(stdout);
+    vigilar(j, PLAZO_MS + GUARDIA_MS);
+    if (j->activo && encolar(j) < 0)         // repone la cola del driver de a una
+      perror("Falla al encolar rondas");
+  }
+  log_poner(j, ev->tipo | ev->flags << 4, ev->ronda, ev->jugador, ev->t_ns, dato);
+  if (ev->tipo == TRIVIA_EV_ARMADA)
+    return;
+  if ((ev->tipo == TRIVIA_EV_GANADOR || ev->tipo == TRIVIA_EV_VENCIDA) && ev->ronda == j->viva)
+    resultado(j, ev);
+  else if (ev->flags & TRIVIA_EVF_TARDIA)
+    printf("Despues se presiono: Boton%u (reaccion %llu.%03llu ms)\n", ev->jugador,
+           (unsigned long long)ev->delta_ns / 1000000, (unsigned long long)ev->delta_ns / 1000 % 1000);
+  else if (ev->flags & TRIVIA_EVF_ANTICIPADA)
+    printf("Boton%u se anticipo\n", ev->jugador);
+}
+
+/** @brief El anillo tiene eventos: se consumen todos directo de la memoria mapeada */
+static int dispositivo(struct juego *j){
+  const struct trivia_evento *ev;
+
+  while ((ev = trivia_anillo_mirar(j->anillo)) != NULL){
+    if (ev->version != TRIVIA_ABI_VERSION){
+      fprintf(stderr, "Registro desconocido (version %u)\n", ev->version);
+      return -EPROTO;
+    }
+    evento(j, ev);
+    trivia_anillo_soltar(j->anillo);
+  }
+  if (j->anillo->desbordes != j->desbordes){
+    j->desbordes = j->anillo->desbordes;
+    fprintf(stderr, "Se perdieron eventos, el anillo se lleno (%u)\n", j->desbordes);
+  }
+  return 0;
+}
+
+/** @brief Vencio el vigilante: la ronda no cerro a tiempo, se le pregunta el resultado al driver */
+static void vigilante(struct juego *j){
+  struct trivia_resultado r = { .plazo_ms = 0 };
+  __u64 vencimientos;
+
+  if (read(j->fdtimer, &vencimientos, sizeof(vencimientos)) < 0 || !j->viva)
+    return;
+  if (ioctl(j->fdlkm, TRIVIA_IOC_RESULTADO, &r) == 0 && r.ev.ronda == j->viva){
+    log_poner(j, r.ev.tipo | r.ev.flags << 4, r.ev.ronda, r.ev.jugador, r.ev.t_ns, r.ev.delta_ns / 1000);
+    resultado(j, &r.ev);
+  } else {
+    vigilar(j, GUARDIA_MS);                  // todavia no hay, se vuelve a mirar
+  }
+}
+
+/** @brief Comandos por stdin, de a una linea */
+static void comando(struct juego *j, int epfd){
+  char linea[64];
+  ssize_t n = read(STDIN_FILENO, linea, sizeof(linea) - 1);
+
+  if (n <= 0){                               // sin terminal (servicio): sigue solo
+    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    if (!j->activo && encolar(j) < 0)
+      perror("Falla al iniciar la sesion");
+    return;
+  }
+  linea[n] = '\0';
+  switch (linea[0]){
+  case '\n':
+    if (!j->activo && encolar(j) < 0)
+      perror("Falla al iniciar la sesion");
+    break;
+  case 'p':
+    pausar(j);
+    printf("Pausa, ENTER para seguir\n");
+    break;
+  case '+':
+    n = strtoul(linea + 1, NULL, 10);
+    if (j->rondas){
+      j->rondas += n;
+      j->porEncolar += n;
+    }
+    if (j->activo && encolar(j) < 0)
+      perror("Falla al encolar rondas");
+    break;
+  case 'e':
+    printf("Rondas jugadas %u de %u, %s, en la cola del driver %u, desbordes %u\n", j->jugadas, j->rondas,
+           j->activo ? "en juego" : "en pausa", j->encoladas, j->anillo->desbordes);
+    break;
+  case 'q':
+    j->salir = 1;
+    break;
+  default:
+    printf("comandos: ENTER arranca o sigue, p pausa, +N suma rondas, e estado, q sale\n");
+  }
+  fflush(stdout);
+}
+
+/** @brief Mapea el anillo de eventos del driver, primero la cabecera para saber la capacidad
+ *  Todo el anillo va solo lectura, y encima la pagina de la cabecera con escritura para avanzar la cola
+ *  (el driver no deja escribir las ranuras).
+ */
+static int mapear(struct juego *j){
+  long pagina = sysconf(_SC_PAGESIZE);
+  struct trivia_anillo *a = mmap(NULL, pagina, PROT_READ, MAP_SHARED, j->fdlkm, 0);
+
+  if (a == MAP_FAILED)
+    return -errno;
+  j->largoAnillo = (TRIVIA_ANILLO_BYTES(a) + pagina - 1) & ~(pagina - 1);
+  munmap(a, pagina);
+  j->anillo = mmap(NULL, j->largoAnillo, PROT_READ, MAP_SHARED, j->fdlkm, 0);
+  if (j->anillo == MAP_FAILED)
+    return -errno;
+  if (mmap(j->anillo, pagina, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, j->fdlkm, 0) == MAP_FAILED)
+    return -errno;
+  j->desbordes = j->anillo->desbordes;
+  return 0;
+}
+
+int main (int argc, char *argv[]){
+
+  struct juego j = { .fdlkm = -1, .fdtimer = -1, .fdlog = -1 };
+  struct epoll_event ev, listos[4];
+  __u32 version;
+  sigset_t senales;
+  int r, i, n, epfd, fdsig;
+  struct banco banco;           // preguntas y respuestas, indexadas por id
+  const char *ruta = argc > 1 ? argv[1] : "preguntas.txt";
+  const char *rutaDispositivo = argc > 3 ? argv[3] : "/dev/trivialkm0";
+  const char *rutaLog = argc > 4 ? argv[4] : "trivia.log";
+  const char *categoria = argc > 5 ? argv[5] : NULL;
+
+  j.rondas = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+  j.porEncolar = j.rondas;
+  r = banco_abrir(&banco, ruta);
+  if (r < 0){
+    fprintf(stderr, "Falla al cargar las preguntas de %s: %s\n", ruta, strerror(-r));
+    return -r;
+  }
+  j.banco = &banco;
+  i = categoria ? banco_categoria(&banco, categoria) : -1;
+  if (categoria && i < 0){
+    fprintf(stderr, "No hay una categoria %s en %s\n", categoria, ruta);
+    return EXIT_FAILURE;
+  }
+  banco_sorteo_iniciar(&j.sorteo, &banco, i, (__u64)time(NULL) << 20 ^ getpid());
+  j.proxima = elegir(&j);
+  if (j.proxima == NULL){
+    fprintf(stderr, "No hay preguntas en %s\n", ruta);
+    return EXIT_FAILURE;
+  }
+  banco_precargar(&banco, j.proxima);
+
+  j.fdlkm = open (rutaDispositivo, O_RDWR);           // abrimos la mesa para lectura/escritura
+  if (j.fdlkm < 0){
     perror("Falla al abrir dev file...");
     return errno;
   }
-  printf("\nPresione ENTER para iniciar el juego\n");
-  getchar();
-  s=(unsigned int)time(NULL);
-  s = s/10;
-  sprintf(comando,"/home/tdiii/lkms/trivia/pregunta.sh %02d:",s); 
-  printf("%s\n",comando);
-  //leo el archivo con las preguntas
-  // mediante un shell script
-  system(comando);
-
-  //con el read lo pongo listo para empezar
-  //debe ser bloqueante hasta que se presiones un boton
-  r = read (fdlkm, buffer, 7); 	//y debe destrancar a la primera interrupcion
-				//En el buffer devuelve el jugador que apreto primero el boton
-  if (r>0){
-    printf("\nPrimero se presiono: %s\n",buffer);
-  } else {
-    perror("Error de lectura");
+  //el driver tiene que hablar el mismo formato de registros que este programa
+  if (ioctl(j.fdlkm, TRIVIA_IOC_VERSION, &version) < 0 || version != TRIVIA_ABI_VERSION){
+    fprintf(stderr, "El driver no es compatible con este programa\n");
+    return EXIT_FAILURE;
+  }
+  r = mapear(&j);
+  if (r < 0){
+    fprintf(stderr, "Falla al mapear el anillo de eventos: %s\n", strerror(-r));
+    return -r;
+  }
+  j.fdlog = open(rutaLog, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (j.fdlog < 0)
+    perror(rutaLog);                        // se juega igual, sin log
+  log_poner(&j, LOG_INICIO, 0, 0, ahora_ns(), time(NULL));
+
+  // Ctrl-C y kill terminan ordenado (sesion cerrada y log escrito), llegan por un fd mas
+  sigemptyset(&senales);
+  sigaddset(&senales, SIGINT);
+  sigaddset(&senales, SIGTERM);
+  sigprocmask(SIG_BLOCK, &senales, NULL);
+  fdsig = signalfd(-1, &senales, SFD_CLOEXEC);
+  j.fdtimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (fdsig < 0 || j.fdtimer < 0 || epfd < 0){
+    perror("Falla al preparar epoll");
     return errno;
   }
-  printf("\nPresione ENTER para la respuesta correcta\n");
-  getchar();
-  sprintf(comando,"/home/tdiii/lkms/trivia/respuesta.sh %02d:",s); 
-  printf("%s\n",comando);
-  //leo el archivo con las respuestas
-  // mediante un shell script
-  system(comando);
-
-    
-  close(fdlkm);
-  
-  
+  // el dispositivo avisa por poll cuando el anillo tiene eventos, los demas son fds comunes
+  ev.events = EPOLLIN;
+  ev.data.fd = j.fdlkm;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, j.fdlkm, &ev);
+  ev.data.fd = j.fdtimer;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, j.fdtimer, &ev);
+  ev.data.fd = fdsig;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, fdsig, &ev);
+  ev.data.fd = STDIN_FILENO;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0 && encolar(&j) < 0)
+    perror("Falla al iniciar la sesion");    // stdin no se puede esperar (archivo, /dev/null): arranca solo
+
+  printf("\n%u preguntas cargadas. Presione ENTER para iniciar el juego (? ayuda)\n", j.sorteo.cantidad);
+  fflush(stdout);
+  while (!j.salir){
+    n = epoll_wait(epfd, listos, 4, -1);
+    if (n < 0 && errno != EINTR){
+      perror("epoll");
+      break;
+    }
+    for (i = 0; i < n && !j.salir; i++){
+      if (listos[i].data.fd == j.fdlkm){
+        if (dispositivo(&j) < 0)
+          j.salir = 1;
+      } else if (listos[i].data.fd == j.fdtimer){
+        vigilante(&j);
+      } else if (listos[i].data.fd == STDIN_FILENO){
+        comando(&j, epfd);
+      } else {
+        j.salir = 1;                         // SIGINT o SIGTERM
+      }
+    }
+  }
+
+  pausar(&j);
+  log_vaciar(&j);
+  printf("\nRondas jugadas: %u\n", j.jugadas);
+  close(epfd);
+  close(fdsig);
+  close(j.fdtimer);
+  if (j.fdlog >= 0)
+    close(j.fdlog);
+  munmap(j.anillo, j.largoAnillo);
+  close(j.fdlkm);
+  banco_cerrar(&banco);
+
+
   return 0;
 }
@@ -0,0 +1,332 @@
+/**
+ * @file   trivia_core.h
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Nucleo del juego, independiente del hardware: estado de la ronda, arbitraje, antirrebote
+ * y colores de los leds. No toca GPIOs ni relojes: el instante llega como parametro y los leds salen
+ * como mascara de bits, el que llama hace el resto (el LKM con ktime y gpiod, triviasim con un reloj
+ * y leds de mentira).
+ * Todo es static inline: en el LKM queda metido en el handler de la IRQ sin llamadas, y el mismo
+ * fuente compila en espacio de usuario sin Kbuild.
+ * @see repo del curso en GIT
+ */
+
+#ifndef TRIVIA_CORE_H
+#define TRIVIA_CORE_H
+
+#include "trivialkm.h"            // struct trivia_evento, tipos y flags
+
+// Lo unico que cambia entre kernel y usuario es como se hacen los accesos atomicos
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+
+typedef atomic_t trivia_atomico;
+#define trivia_atomico_leer(a)                atomic_read(a)
+#define trivia_atomico_leer_acquire(a)        atomic_read_acquire(a)
+#define trivia_atomico_poner(a, v)            atomic_set(a, v)
+#define trivia_atomico_publicar(a, v)         atomic_set_release(a, v)
+#define trivia_atomico_cas(a, viejo, nuevo)   atomic_try_cmpxchg(a, viejo, nuevo)
+#define TRIVIA_LEER(x)                        READ_ONCE(x)
+#define TRIVIA_ESCRIBIR(x, v)                 WRITE_ONCE(x, v)
+#else
+#include <stdbool.h>
+
+typedef struct { int v; } trivia_atomico;
+static inline int trivia_atomico_leer(trivia_atomico *a){
+   return __atomic_load_n(&a->v, __ATOMIC_RELAXED);
+}
+static inline int trivia_atomico_leer_acquire(trivia_atomico *a){
+   return __atomic_load_n(&a->v, __ATOMIC_ACQUIRE);
+}
+static inline void trivia_atomico_poner(trivia_atomico *a, int v){
+   __atomic_store_n(&a->v, v, __ATOMIC_RELAXED);
+}
+static inline void trivia_atomico_publicar(trivia_atomico *a, int v){
+   __atomic_store_n(&a->v, v, __ATOMIC_RELEASE);
+}
+static inline bool trivia_atomico_cas(trivia_atomico *a, int *viejo, int nuevo){
+   return __atomic_compare_exchange_n(&a->v, viejo, nuevo, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+#define TRIVIA_LEER(x)                        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define TRIVIA_ESCRIBIR(x, v)                 __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+
+// Puntos donde triviasim puede frenar un hilo para forzar un intercalado entre presion y armado;
+// en el LKM no hacen nada
+#define TRIVIA_PAUSA_RECLAMAR 1   ///< la presion ya leyo la palabra, todavia no leyo tArmado ni hizo el cmpxchg
+#define TRIVIA_PAUSA_ARMAR    2   ///< el armado ya cerro la ronda vieja y escribio los tiempos, falta publicar
+#ifndef TRIVIA_CORE_PAUSA
+#define TRIVIA_CORE_PAUSA(punto) do {} while (0)
+#endif
+
+#define TRIVIA_MAX_JUGADORES 16   ///< tope de jugadores (un boton y tres leds cada uno), los leds entran en 64 bits
+#define TRIVIA_NUNCA  (~0ULL)     ///< tVence de una ronda sin plazo
+
+// Estado de la ronda: una sola palabra atomica que se reclama con compare-and-swap desde las IRQs.
+// Formato: [31..16] nro de ronda | [15..8] jugador ganador | [7..0] estado
+// El nro de ronda evita que una presion vieja reclame una ronda nueva que tenga el mismo estado (ABA).
+// Los colores de los leds se derivan del estado: azul=standby, verde=gano pulseada, rojo=perdio
+#define TRIVIA_LIBRE    0         ///< dispositivo cerrado, todo apagado, los botones no cuentan
+#define TRIVIA_ESPERA   1         ///< abierto, leds azules (standby), los botones no cuentan
+#define TRIVIA_ARMADA   2         ///< leds apagados, el primero que aprieta gana
+#define TRIVIA_GANADA   3         ///< verde para el ganador, rojo para el resto
+#define TRIVIA_VENCIDA  4         ///< nadie apreto antes del plazo, todos en rojo
+#define TRIVIA_ARMANDO  5         ///< cerrada mientras se arma la siguiente, conserva el nro viejo; los botones no cuentan
+
+#define RONDA_PALABRA(nro, jugador, estado) ((int)((((nro) & 0xffff) << 16) | (((jugador) & 0xff) << 8) | ((estado) & 0xff)))
+#define RONDA_NRO(palabra)     (((unsigned int)(palabra) >> 16) & 0xffff)
+#define RONDA_JUGADOR(palabra) (((unsigned int)(palabra) >> 8) & 0xff)
+#define RONDA_ESTADO(palabra)  ((unsigned int)(palabra) & 0xff)
+
+// Banco de leds: tres por jugador, el bit LED(nro, color) de la mascara es el led de ese color
+#define LED_ROJO   0
+#define LED_VERDE  1
+#define LED_AZUL   2
+#define LED(nro, color)  (((nro) - 1) * 3 + (color))      ///< posicion del led de un jugador en el banco
+#define TRIVIA_MAX_LEDS  (3 * TRIVIA_MAX_JUGADORES)
+
+/** @brief Estado del juego */
+struct trivia_core {
+   trivia_atomico estado;     ///< palabra de estado de la ronda actual
+   __u64 tArmado;             ///< instante (ns) en que se armo la ronda actual
+   __u64 tVence;              ///< instante (ns) en que vence la ronda actual, TRIVIA_NUNCA sin plazo
+   unsigned int nJugadores;   ///< cantidad de jugadores
+   __u64 rojos;               ///< mascara con los rojos de todos los jugadores
+   __u64 azules;              ///< mascara con los azules de todos los jugadores
+};
+
+/** @brief Deja el juego libre (todo apagado) para nJugadores, a lo sumo TRIVIA_MAX_JUGADORES */
+static inline void trivia_core_iniciar(struct trivia_core *c, unsigned int nJugadores){
+   unsigned int j;
+
+   trivia_atomico_poner(&c->estado, RONDA_PALABRA(0, 0, TRIVIA_LIBRE));
+   c->tArmado = 0;
+   c->tVence = TRIVIA_NUNCA;
+   c->nJugadores = nJugadores;
+   c->rojos = c->azules = 0;
+   for (j = 1; j <= nJugadores; j++){     // las mascaras se precalculan, el arbitraje no recorre jugadores
+      c->rojos  |= 1ULL << LED(j, LED_ROJO);
+      c->azules |= 1ULL << LED(j, LED_AZUL);
+   }
+}
+
+/** @brief Palabra de estado actual */
+static inline int trivia_core_palabra(struct trivia_core *c){
+   return trivia_atomico_leer(&c->estado);
+}
+
+/** @brief Siguiente nro de ronda despues de nro, salteando el 0 (TRIVIA_IOC_ARMAR lo usa como "el siguiente") */
+static inline unsigned int trivia_core_siguiente(unsigned int nro){
+   nro = (nro + 1) & 0xffff;
+   return nro ? nro : 1;
+}
+
+/** @brief La ronda cerrada? (ganada o vencida, no hay ronda en juego) */
+static inline bool trivia_core_cerrada(int palabra){
+   return RONDA_ESTADO(palabra) == TRIVIA_GANADA || RONDA_ESTADO(palabra) == TRIVIA_VENCIDA;
+}
+
+/** @brief Cambia a un estado sin ronda en juego (libre o espera), conservando el nro de ronda
+ *  Para armar se usa trivia_core_armar(), que cambia el nro de ronda.
+ *  @return la palabra nueva
+ */
+static inline int trivia_core_estado(struct trivia_core *c, unsigned int estado){
+   int nuevo = RONDA_PALABRA(RONDA_NRO(trivia_core_palabra(c)), 0, estado);
+
+   trivia_atomico_poner(&c->estado, nuevo);
+   return nuevo;
+}
+
+/** @brief Arma una ronda nueva
+ *  El nro de ronda tiene que ser distinto del actual, asi una IRQ que leyo la palabra vieja
+ *  no puede reclamar la ronda nueva. Lo llama un solo armador a la vez.
+ *  Primero saca a la ronda vieja de ARMADA con un cmpxchg (queda en TRIVIA_ARMANDO con su nro), y
+ *  recien despues toca tArmado y tVence: una presion que todavia ve la ronda vieja armada no puede
+ *  ganarla con los tiempos de la nueva, y la que le gano al cierre queda ganada con los suyos.
+ *  @param plazo ns para apretar, 0 sin plazo
+ *  @return la palabra nueva
+ */
+static inline int trivia_core_armar(struct trivia_core *c, unsigned int nro, __u64 ahora, __u64 plazo){
+   int viejo = trivia_core_palabra(c);
+   int nuevo = RONDA_PALABRA(nro, 0, TRIVIA_ARMADA);
+
+   while (!trivia_atomico_cas(&c->estado, &viejo, (viejo & ~0xff) | TRIVIA_ARMANDO))
+      ;                                         // solo falla si una presion o el plazo la cerraron recien
+   TRIVIA_ESCRIBIR(c->tArmado, ahora);           // el cmpxchg exitoso es barrera completa: van despues del cierre
+   TRIVIA_ESCRIBIR(c->tVence, plazo ? ahora + plazo : TRIVIA_NUNCA);
+   TRIVIA_CORE_PAUSA(TRIVIA_PAUSA_ARMAR);
+   trivia_atomico_publicar(&c->estado, nuevo);   // tArmado y tVence quedan visibles antes que la ronda armada
+   return nuevo;
+}
+
+/** @brief Tiempo desde el armado, 0 si la presion es anterior (tArmado ya es de una ronda mas nueva) */
+static inline __u64 trivia_core_delta(__u64 ahora, __u64 tArmado){
+   return ahora > tArmado ? ahora - tArmado : 0;
+}
+
+/** @brief Intenta reclamar la ronda armada para un jugador
+ *  Sin locks: el compare-and-swap exitoso es el punto de linealizacion, de todas las presiones que
+ *  ven la ronda armada (en cualquier CPU) gana una sola y las demas fallan el cmpxchg porque la
+ *  palabra ya cambio.
+ *  Un solo intento, y solo sobre la ronda que se vio: si el cmpxchg falla gano otro, vencio o se
+ *  re-armo, y una presion vieja nunca reclama una ronda mas nueva. Tampoco una armada despues del
+ *  instante de la presion (la IRQ toma el tiempo antes de mirar la palabra).
+ *  @param visto si no gano, devuelve la palabra que perdio, para armar el evento de la presion
+ *  @param tArmado si gano, el instante de armado de su ronda
+ *  @return la palabra con la ronda ganada si este jugador gano, 0 si no
+ */
+static inline int trivia_core_reclamar(struct trivia_core *c, unsigned int jugador, __u64 ahora, int *visto, __u64 *tArmado){
+   int viejo = trivia_atomico_leer_acquire(&c->estado);   // con el tArmado de esa ronda visible
+
+   TRIVIA_CORE_PAUSA(TRIVIA_PAUSA_RECLAMAR);
+   *tArmado = TRIVIA_LEER(c->tArmado);      // si ya es de la ronda siguiente, el armado cerro esta y el cmpxchg falla
+   if (RONDA_ESTADO(viejo) == TRIVIA_ARMADA && ahora >= *tArmado){
+      int nuevo = RONDA_PALABRA(RONDA_NRO(viejo), jugador, TRIVIA_GANADA);
+
+      if (trivia_atomico_cas(&c->estado, &viejo, nuevo))
+         return nuevo;
+   }
+   *visto = viejo;                             // standby, cerrado, alguien ya gano o ronda mas nueva
+   return 0;
+}
+
+/** @brief Procesa una presion valida (ya pasada por el antirrebote): arbitraje y registro
+ *  Toda presion deja registro: el ganador, y los segundos puestos y tardias para revisar empates,
+ *  las anticipadas para estadisticas.
+ *  @param ev se completa con el registro de la presion
+ *  @return la palabra con la ronda ganada si este jugador gano, 0 si no
+ */
+static inline int trivia_core_presion(struct trivia_core *c, unsigned int jugador, __u64 ahora, struct trivia_evento *ev){
+   __u64 tArmado;
+   int visto, palabra = trivia_core_reclamar(c, jugador, ahora, &visto, &tArmado);
+
+   ev->version  = TRIVIA_ABI_VERSION;
+   ev->largo    = sizeof(*ev);
+   ev->jugador  = jugador;
+   ev->reservado = 0;
+   ev->t_ns     = ahora;
+   ev->delta_ns = 0;
+   if (palabra){
+      ev->tipo     = TRIVIA_EV_GANADOR;
+      ev->ronda    = RONDA_NRO(palabra);
+      ev->flags    = 0;
+      ev->delta_ns = ahora - tArmado;          // el de la ronda ganada, leido antes del cmpxchg
+   } else {
+      ev->tipo  = TRIVIA_EV_PRESION;
+      ev->ronda = RONDA_NRO(visto);
+      if (trivia_core_cerrada(visto)){         // despues del ganador o del plazo
+         ev->flags    = TRIVIA_EVF_TARDIA;
+         ev->delta_ns = trivia_core_delta(ahora, TRIVIA_LEER(c->tArmado));
+      } else {
+         ev->flags    = TRIVIA_EVF_ANTICIPADA;
+      }
+   }
+   return palabra;
+}
+
+/** @brief Vence la ronda armada si paso su plazo
+ *  Usa el mismo cmpxchg que las presiones, asi entre un boton y el plazo gana uno solo. Si entre
+ *  tanto se armo otra ronda, su tVence es posterior y no se toca.
+ *  @param ev se completa con el registro TRIVIA_EV_VENCIDA si vencio
+ *  @return la palabra de la ronda vencida, 0 si no vencio
+ */
+static inline int trivia_core_vencer(struct trivia_core *c, __u64 ahora, struct trivia_evento *ev){
+   int armada = trivia_atomico_leer_acquire(&c->estado);
+   int vencida = RONDA_PALABRA(RONDA_NRO(armada), 0, TRIVIA_VENCIDA);
+   __u64 tArmado = TRIVIA_LEER(c->tArmado);    // antes del cmpxchg, despues se puede re-armar
+
+   if (RONDA_ESTADO(armada) != TRIVIA_ARMADA || ahora < TRIVIA_LEER(c->tVence))
+      return 0;
+   if (!trivia_atomico_cas(&c->estado, &armada, vencida))
+      return 0;                                // un boton llego antes, o se re-armo
+   ev->version   = TRIVIA_ABI_VERSION;
+   ev->tipo      = TRIVIA_EV_VENCIDA;
+   ev->largo     = sizeof(*ev);
+   ev->ronda     = RONDA_NRO(vencida);
+   ev->jugador   = 0;
+   ev->flags     = 0;
+   ev->reservado = 0;
+   ev->t_ns      = ahora;
+   ev->delta_ns  = trivia_core_delta(ahora, tArmado);
+   return vencida;
+}
+
+/** @brief Antirrebote de un boton */
+struct trivia_antirrebote {
+   __u64 ultimo;              ///< instante del ultimo flanco (de subida o de bajada, valido o rebote)
+   bool dosFlancos;           ///< llegan los dos flancos con el nivel de la linea; si no, solo los de subida
+   bool apretado;             ///< hubo una presion valida y todavia no se vio la linea baja
+};
+
+#define TRIVIA_FLANCO_PRESION 0   ///< presion valida, va al arbitraje
+#define TRIVIA_FLANCO_REBOTE  1   ///< subida dentro de la ventana o sin soltar, se descarta y se cuenta
+#define TRIVIA_FLANCO_SUELTA  2   ///< bajada, el boton se solto (o rebota al soltar), se descarta sin contar
+
+/** @brief Deja el antirrebote de un boton sin flancos vistos y suelto */
+static inline void trivia_core_antirrebote_iniciar(struct trivia_antirrebote *a, bool dosFlancos){
+   a->ultimo = 0;
+   a->dosFlancos = dosFlancos;
+   a->apretado = false;
+}
+
+/** @brief Antirrebote de un boton: una subida vale solo si la linea estuvo quieta toda la ventana
+ *  Con los dos flancos ademas tuvo que estar baja (el boton suelto) toda la ventana, asi los rebotes
+ *  al soltar no pasan como presiones nuevas aunque el boton haya estado apretado mucho mas que la
+ *  ventana. Solo con flancos de subida la suelta no se ve, y un rebote al soltar despues de la ventana
+ *  pasa como presion.
+ *  La primera subida de una rafaga pasa enseguida con su propio tiempo (no se espera a que termine de
+ *  rebotar, para no perjudicar a nadie), las que le siguen dentro de la ventana son rebotes.
+ *  @param alto nivel de la linea en el flanco, se ignora si solo llegan las subidas
+ *  @return TRIVIA_FLANCO_PRESION, TRIVIA_FLANCO_REBOTE o TRIVIA_FLANCO_SUELTA
+ */
+static inline int trivia_core_rebote(struct trivia_antirrebote *a, bool alto, __u64 ahora, __u64 ventana){
+   bool quieto = ahora - a->ultimo >= ventana;
+
+   a->ultimo = ahora;                           // cualquier flanco reinicia la ventana
+   if (!a->dosFlancos)
+      return quieto ? TRIVIA_FLANCO_PRESION : TRIVIA_FLANCO_REBOTE;
+   if (!alto){
+      a->apretado = false;
+      return TRIVIA_FLANCO_SUELTA;
+   }
+   if (!quieto || a->apretado)                  // rebote, o se perdio la bajada y sigue apretado
+      return TRIVIA_FLANCO_REBOTE;
+   a->apretado = true;
+   return TRIVIA_FLANCO_PRESION;
+}
+
+/** @brief Mascara de leds para una palabra de estado
+ *  azul=standby, apagado=armada, verde para el ganador y rojo para el resto, todos rojos si vencio
+ */
+static inline __u64 trivia_core_leds(const struct trivia_core *c, int palabra){
+   unsigned int ganador = RONDA_JUGADOR(palabra);
+
+   switch (RONDA_ESTADO(palabra)){
+   case TRIVIA_ESPERA:
+      return c->azules;
+   case TRIVIA_VENCIDA:
+      return c->rojos;                         // nadie llego: todos pierden
+   case TRIVIA_GANADA:
+      if (ganador >= 1 && ganador <= c->nJugadores)
+         return (c->rojos & ~(1ULL << LED(ganador, LED_ROJO))) | 1ULL << LED(ganador, LED_VERDE);
+      return 0;
+   default:
+      return 0;
+   }
+}
+
+/** @brief Mascara de leds a partir de mascaras por color (bit i = jugador i+1), para TRIVIA_IOC_LEDS */
+static inline __u64 trivia_core_leds_manual(const struct trivia_core *c, __u32 rojos, __u32 verdes, __u32 azules){
+   __u64 m = 0;
+   unsigned int i;
+
+   for (i = 0; i < c->nJugadores; i++){
+      m |= (__u64)((rojos  >> i) & 1) << LED(i + 1, LED_ROJO);
+      m |= (__u64)((verdes >> i) & 1) << LED(i + 1, LED_VERDE);
+      m |= (__u64)((azules >> i) & 1) << LED(i + 1, LED_AZUL);
+   }
+   return m;
+}
+
+#endif
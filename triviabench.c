@@ -0,0 +1,269 @@
+/**
+ * @file   triviabench.c
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Banco de pruebas del driver trivialkm sobre gpio-sim
+ * inyecta flancos en los botones escribiendo el pull de las lineas simuladas y mide contra los
+ * registros que devuelve read(): latencia de la IRQ y hasta el usuario, arbitraje con presiones
+ * casi simultaneas y eventos perdidos con rafagas. El resultado sale en JSON por stdout.
+ * se corre desde bench.sh, que arma el chip simulado y carga el modulo con esas lineas
+ * uso: triviabench -s <dir del chip en /sys/devices/platform> [-j jugadores] [-r rondas] [-p pares] [-c presiones] [-t presiones/s]
+ * @see repo del curso en GIT
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/ioctl.h>
+
+#include "trivialkm.h"   // registros de read() e ioctls
+
+#define MAX_JUGADORES 16
+#define SYSFS "/sys/class/fslkm/trivialkm0/"   // la primera mesa, bench.sh carga una sola
+#define ESPERA_MS 1000   // si en este tiempo no llega el evento de una presion se cuenta perdida
+
+static int fdlkm;
+static int pull[MAX_JUGADORES];  // sim_gpioN/pull de cada boton, abiertos una sola vez
+static unsigned int jugadores = 2;
+
+static unsigned long long ahora_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);    // el mismo reloj que ktime_get_ns() en el driver
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief Sube o baja el boton j (desde 0), el driver cuenta el flanco de subida */
+static int boton(unsigned int j, int arriba){
+  const char *v = arriba ? "pull-up" : "pull-down";
+
+  return pwrite(pull[j], v, strlen(v), 0) < 0 ? -errno : 0;
+}
+
+/** @brief Una presion completa, devuelve el instante justo antes del flanco */
+static unsigned long long presionar(unsigned int j){
+  unsigned long long t = ahora_ns();
+
+  boton(j, 1);
+  boton(j, 0);
+  return t;
+}
+
+/** @brief Arma una ronda por ioctl, devuelve su nro o 0 si falla */
+static unsigned int armar(void){
+  struct trivia_armar a = { 0 };
+
+  if (ioctl(fdlkm, TRIVIA_IOC_ARMAR, &a) < 0){
+    perror("TRIVIA_IOC_ARMAR");
+    return 0;
+  }
+  return a.ronda;
+}
+
+/** @brief Lee los registros disponibles, esperando hasta ESPERA_MS al primero
+ *  @return cantidad de registros, 0 si no llego nada a tiempo
+ */
+static int leer(struct trivia_evento *ev, int max, unsigned long long *t){
+  struct pollfd p = { .fd = fdlkm, .events = POLLIN };
+  int r;
+
+  if (poll(&p, 1, ESPERA_MS) <= 0)
+    return 0;
+  r = read(fdlkm, ev, max * sizeof(*ev));
+  *t = ahora_ns();
+  return r < 0 ? 0 : r / (int)sizeof(*ev);
+}
+
+static unsigned long long sysfs_valor(const char *nombre){
+  char ruta[128], buf[32];
+  int fd, n;
+
+  snprintf(ruta, sizeof(ruta), SYSFS "%s", nombre);
+  fd = open(ruta, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+  return strtoull(buf, NULL, 10);
+}
+
+static int comparar(const void *a, const void *b){
+  unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/** @brief Imprime p50/p90/p99/p999/max de n muestras como objeto JSON (ordena las muestras) */
+static void percentiles(const char *nombre, unsigned long long *m, unsigned int n, const char *sep){
+  qsort(m, n, sizeof(*m), comparar);
+  printf("    \"%s\": {\"muestras\": %u", nombre, n);
+  if (n)
+    printf(", \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu",
+           m[n / 2], m[n * 90 / 100], m[n * 99 / 100], m[n * 999 / 1000], m[n - 1]);
+  printf("}%s\n", sep);
+}
+
+/** @brief Latencia: una presion por ronda, de un jugador distinto cada vez */
+static void latencia(unsigned int rondas){
+  unsigned long long *irq = calloc(rondas, sizeof(*irq));
+  unsigned long long *lectura = calloc(rondas, sizeof(*lectura));
+  unsigned long long *total = calloc(rondas, sizeof(*total));
+  unsigned long long t0, t;
+  struct trivia_evento ev[16];
+  unsigned int i, n = 0, perdidas = 0, ronda;
+  int k, r, listo;
+
+  for (i = 0; i < rondas; i++){
+    ronda = armar();
+    t0 = presionar(i % jugadores);
+    for (listo = 0; !listo; ){
+      r = leer(ev, 16, &t);
+      if (r == 0){
+        perdidas++;
+        break;
+      }
+      for (k = 0; k < r; k++)
+        if (ev[k].tipo == TRIVIA_EV_GANADOR && ev[k].ronda == ronda){
+          irq[n]     = ev[k].t_ns - t0;     // del flanco a la entrada a la IRQ
+          lectura[n] = t - ev[k].t_ns;      // de la IRQ a la vuelta de read()
+          total[n++] = t - t0;
+          listo = 1;
+        }
+    }
+  }
+  printf("  \"latencia\": {\n    \"rondas\": %u,\n    \"perdidas\": %u,\n", rondas, perdidas);
+  percentiles("flanco_irq_ns", irq, n, ",");
+  percentiles("irq_lectura_ns", lectura, n, ",");
+  percentiles("total_ns", total, n, "");
+  printf("  },\n");
+  free(irq);
+  free(lectura);
+  free(total);
+}
+
+/** @brief Arbitraje: dos jugadores casi a la vez, tiene que haber un solo ganador y ser el primero en el tiempo */
+static void pares(unsigned int rondas){
+  struct trivia_evento ev[16];
+  unsigned long long t;
+  unsigned int i, a, b, ronda, ganadores, presiones, incompletas = 0, errores = 0, orden = 0;
+  unsigned long long tGanador, tOtro;
+  int k, r;
+
+  if (jugadores < 2){
+    printf("  \"pares\": null,\n");
+    return;
+  }
+  for (i = 0; i < rondas; i++){
+    a = i % jugadores;
+    b = (a + 1) % jugadores;
+    ronda = armar();
+    boton(a, 1);                      // los dos flancos seguidos, sin bajar el primero
+    boton(b, 1);
+    boton(a, 0);
+    boton(b, 0);
+    ganadores = presiones = 0;
+    tGanador = tOtro = 0;
+    while (ganadores + presiones < 2 && (r = leer(ev, 16, &t)) > 0)
+      for (k = 0; k < r; k++){
+        if (ev[k].ronda != ronda)
+          continue;
+        if (ev[k].tipo == TRIVIA_EV_GANADOR){
+          ganadores++;
+          tGanador = ev[k].t_ns;
+          orden += ev[k].jugador == a + 1;
+        } else if (ev[k].tipo == TRIVIA_EV_PRESION){
+          presiones++;
+          tOtro = ev[k].t_ns;
+        }
+      }
+    if (ganadores + presiones < 2)
+      incompletas++;
+    else if (ganadores != 1 || tGanador > tOtro)   // dos ganadores, o gano el que llego despues
+      errores++;
+  }
+  printf("  \"pares\": {\"rondas\": %u, \"errores_arbitraje\": %u, \"incompletas\": %u, \"gano_el_primero\": %u},\n",
+         rondas, errores, incompletas, orden);
+}
+
+/** @brief Carga: rafaga de presiones a la tasa pedida (0 = lo mas rapido posible) y cuantas llegaron */
+static void carga(unsigned int cantidad, unsigned int tasa){
+  struct trivia_evento ev[256];
+  unsigned long long t0, t, fin, desbordes0 = sysfs_valor("desbordes");
+  unsigned long long periodo = tasa ? 1000000000ULL / tasa : 0;
+  unsigned int i, recibidas = 0;
+  int r;
+
+  armar();
+  t0 = ahora_ns();
+  for (i = 0; i < cantidad; i++){
+    while (periodo && ahora_ns() < t0 + i * periodo)
+      ;                               // espera activa, sleep no tiene resolucion para tasas altas
+    presionar(i % jugadores);
+  }
+  fin = ahora_ns();
+  while (recibidas < cantidad && (r = leer(ev, 256, &t)) > 0)
+    recibidas += r;
+  printf("  \"carga\": {\"inyectadas\": %u, \"recibidas\": %u, \"desbordes\": %llu, \"presiones_por_s\": %.0f},\n",
+         cantidad, recibidas, sysfs_valor("desbordes") - desbordes0, cantidad * 1e9 / (fin - t0));
+}
+
+int main(int argc, char *argv[]){
+  unsigned int rondas = 1000, nPares = 1000, cantidad = 10000, tasa = 0, j;
+  const char *sim = NULL;
+  char ruta[512];
+  __u32 version;
+  int op;
+
+  while ((op = getopt(argc, argv, "s:j:r:p:c:t:")) != -1){
+    switch (op){
+    case 's': sim = optarg; break;
+    case 'j': jugadores = strtoul(optarg, NULL, 10); break;
+    case 'r': rondas = strtoul(optarg, NULL, 10); break;
+    case 'p': nPares = strtoul(optarg, NULL, 10); break;
+    case 'c': cantidad = strtoul(optarg, NULL, 10); break;
+    case 't': tasa = strtoul(optarg, NULL, 10); break;
+    default:
+      fprintf(stderr, "uso: %s -s <chip gpio-sim> [-j jugadores] [-r rondas] [-p pares] [-c presiones] [-t presiones/s]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (sim == NULL || jugadores == 0 || jugadores > MAX_JUGADORES){
+    fprintf(stderr, "Falta el chip simulado (-s) o la cantidad de jugadores es invalida\n");
+    return EXIT_FAILURE;
+  }
+  // los botones son las primeras lineas del chip, como las pone bench.sh
+  for (j = 0; j < jugadores; j++){
+    snprintf(ruta, sizeof(ruta), "%s/sim_gpio%u/pull", sim, j);
+    pull[j] = open(ruta, O_WRONLY);
+    if (pull[j] < 0 || boton(j, 0)){
+      perror(ruta);
+      return errno;
+    }
+  }
+  fdlkm = open("/dev/trivialkm0", O_RDWR);
+  if (fdlkm < 0){
+    perror("Falla al abrir dev file...");
+    return errno;
+  }
+  if (ioctl(fdlkm, TRIVIA_IOC_VERSION, &version) < 0 || version != TRIVIA_ABI_VERSION){
+    fprintf(stderr, "El driver no es compatible con este programa\n");
+    return EXIT_FAILURE;
+  }
+  ioctl(fdlkm, TRIVIA_IOC_RESET);
+
+  printf("{\n  \"version\": %u,\n  \"jugadores\": %u,\n", version, jugadores);
+  latencia(rondas);
+  pares(nPares);
+  carga(cantidad, tasa);
+  printf("  \"irq_max_ns\": %llu,\n  \"irq_prom_ns\": %llu\n}\n", sysfs_valor("irq_max_ns"), sysfs_valor("irq_prom_ns"));
+
+  close(fdlkm);
+  return 0;
+}
@@ -3,23 +3,55 @@
  * @author Juan A. Montenegro	
  * @date   26 Oct 2016
  * @version 0.1
- * @brief   Diver LKM para BeagelBone Black que utiliza dos pulsadores y dos leds
+ * @brief   Diver LKM para BeagelBone Black que utiliza un pulsador y un led RGB por jugador
  * conectados a ports GPIO e implementa un juego de preguntas y respuestas
+ * los pines se pasan como parametros (botones=, rojos=, verdes=, azules=), por defecto dos jugadores
+ * los jugadores se reparten en mesas (mesas=), cada una es un juego independiente en /dev/trivialkmN
  * el archivo con las preguntas y sus respuestas se ingresa por medio de sysfs
   * @see repo del curso en GIT
  */
 
 #include <linux/init.h>           // Macros para funciones ej. __init __exit
+#include <linux/version.h>        // class_create y hrtimer cambiaron de firma, sysfs_emit es de 5.10
 #include <linux/module.h>         // Core header para carga de LKMs en el kernel
+#include <linux/moduleparam.h>    // pines de botones y leds como parametros del modulo
 #include <linux/device.h>         // Header soporte del kernel Driver Model
 #include <linux/kernel.h>         // types, macros, y funciones para el kernel
 #include <linux/fs.h>             // Header para soporte del filesys Linux
 #include <linux/gpio.h>           // soporte de uso de GPIO
+#include <linux/gpio/consumer.h>  // descriptores, para escribir todos los leds de una vez
+#include <linux/bitmap.h>         // el banco de leds como mascara de bits
 #include <linux/interrupt.h>      // soporte de uso de IRQ
+#include <linux/atomic.h>         // atomic_t y compare-and-swap para el arbitraje
+#include <linux/ktime.h>          // ktime_get_ns() para los tiempos de presion
+#include <linux/wait.h>           // wait queue para el read() bloqueante
+#include <linux/poll.h>           // poll/select/epoll sobre el dispositivo
+#include <linux/mutex.h>          // serializa a los lectores
+#include <linux/vmalloc.h>        // memoria del anillo de eventos, mapeable al usuario
+#include <linux/mm.h>             // mmap del anillo
+#include <linux/hrtimer.h>        // re-armado automatico de la sesion
+#include <linux/workqueue.h>      // leds desde el hrtimer, que no puede dormir
+#include <linux/u64_stats_sync.h> // estadisticas de 64 bits legibles sin locks en 32 bits
+#include <linux/compat.h>         // ioctl de procesos de 32 bits, las estructuras son iguales
 #include <asm/uaccess.h>          // requerido para la funcion de copia al usuario
 
-#define  DEVICE_NAME "trivialkm"  ///< el dispositivo aparece con este nombre en /dev
+#include "trivialkm.h"            // registros binarios y anillo de eventos compartidos con el usuario
+#include "trivia_core.h"          // estado de la ronda, arbitraje y colores, sin hardware
+#define CREATE_TRACE_POINTS
+#include "trivialkm_trace.h"      // tracepoints, reemplazan a los printk del camino de la IRQ
+
+#define  DEVICE_NAME "trivialkm"  ///< el dispositivo aparece con este nombre en /dev, seguido del nro de mesa
 #define  CLASS_NAME  "fslkm"      ///< nombre de la clase de dispositivo en el sysfs
+#define  TRIVIA_MAX_COLA 0xffff   ///< tope de rondas encoladas en la sesion
+#define  TRIVIA_MAX_MESAS 8       ///< tope de mesas, cada una es un nro menor
+#define  TRIVIA_PWM_NIVELES 16    ///< niveles de brillo del PWM por software de las animaciones
+#define  TRIVIA_PWM_PASO_NS (625 * NSEC_PER_USEC)   ///< un nivel, el ciclo de PWM es de 10 ms (100 Hz, sin parpadeo visible)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+// sysfs_emit llego en 5.10; lo mismo, acotado a la pagina que da el sysfs
+#define sysfs_emit(buf, fmt, ...)         scnprintf(buf, PAGE_SIZE, fmt, ##__VA_ARGS__)
+#define sysfs_emit_at(buf, at, fmt, ...)  scnprintf((buf) + (at), PAGE_SIZE - (at), fmt, ##__VA_ARGS__)
+#endif
 
 MODULE_LICENSE("GPL");            ///< Tipo de licencia
 MODULE_AUTHOR("Juan A. Montenegro");    ///< Autor, visible con modinfo
@@ -27,31 +59,179 @@ MODULE_DESCRIPTION("Juego de trivia con botones y luces");  ///< Descripcion vis
 MODULE_VERSION("0.1");            ///< Numero de versionado
 
 static int    majorNumber;                  ///< Almacena el numero mayor de device, se determina automaticamente en este ejemplo
-static char   message[256] = {0};           ///< Memoria para la string de los mensajes de pregunta y respuesta hacia espaci de usaurio
-static int    size_of_message;              ///< Para el mensaje
-static int    numberPresses = 0;            ///< acumulador de botonazos
 static struct class*  triviaClass  = NULL; 	///< puntero a device-driver class struct 
-static struct device* triviaDevice = NULL; 	///< puntero a device-driver device struct
-static unsigned int irq1;          			///< irq para el boton 1
-static unsigned int irq2;          			///< irq para el boton 2
-static unsigned char boton;					///< nro de boton para devolver en read()
 
-static unsigned int gpioR1 = 49;       ///< Harcodeamos los leds a pines de gpio
-static unsigned int gpioR2 = 44;       ///< Harcodeamos los leds a pines de gpio
-static unsigned int gpioV1 = 48;       ///< Harcodeamos los leds a pines de gpio
-static unsigned int gpioV2 = 45;       ///< Harcodeamos los leds a pines de gpio
-static unsigned int gpioA1 = 20;       ///< Harcodeamos los leds a pines de gpio
-static unsigned int gpioA2 = 47;       ///< Harcodeamos los leds a pines de gpio
+#define TRIVIA_MAX_EVENTOS  (1u << 16)      ///< tope de eventos, el anillo no pasa de unos MB de vmalloc
+static unsigned int eventos = 256;          ///< ranuras del anillo de eventos de cada mesa
+module_param(eventos, uint, S_IRUGO);
+MODULE_PARM_DESC(eventos, "Capacidad del anillo de eventos de cada mesa, potencia de 2 hasta 65536 (por defecto 256)");
+
+static unsigned int plazo_ms;               ///< plazo de las rondas que arma read(), 0 = sin plazo
+module_param(plazo_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(plazo_ms, "Plazo en ms para apretar en las rondas que arma read(), 0 sin plazo (por defecto)");
+
+
+// Pines por defecto: los dos jugadores originales de la BeagleBone
+static unsigned int botones[TRIVIA_MAX_JUGADORES] = { 60, 61 };   ///< los botones pulsadores, uno por jugador
+static unsigned int rojos[TRIVIA_MAX_JUGADORES]   = { 49, 44 };   ///< leds rojos (perdio)
+static unsigned int verdes[TRIVIA_MAX_JUGADORES]  = { 48, 45 };   ///< leds verdes (gano)
+static unsigned int azules[TRIVIA_MAX_JUGADORES]  = { 20, 47 };   ///< leds azules (standby)
+static unsigned int antirrebote_us[TRIVIA_MAX_JUGADORES];        ///< ventana de antirrebote de cada boton, en microsegundos
+static unsigned int nBotones = 2, nRojos = 2, nVerdes = 2, nAzules = 2, nAntirrebote;
+module_param_array(botones, uint, &nBotones, S_IRUGO);
+MODULE_PARM_DESC(botones, "GPIOs de los pulsadores, uno por jugador (por defecto 60,61)");
+module_param_array(rojos, uint, &nRojos, S_IRUGO);
+MODULE_PARM_DESC(rojos, "GPIOs de los leds rojos, en el mismo orden que botones");
+module_param_array(verdes, uint, &nVerdes, S_IRUGO);
+MODULE_PARM_DESC(verdes, "GPIOs de los leds verdes, en el mismo orden que botones");
+module_param_array(azules, uint, &nAzules, S_IRUGO);
+MODULE_PARM_DESC(azules, "GPIOs de los leds azules, en el mismo orden que botones");
+module_param_array(antirrebote_us, uint, &nAntirrebote, S_IRUGO);
+MODULE_PARM_DESC(antirrebote_us, "Ventana de antirrebote en us de cada boton, en el mismo orden que botones; los que faltan "
+                 "toman el ultimo valor dado, 0 la desactiva (por defecto 5000). Una presion cuenta si el boton "
+                 "estuvo suelto y quieto toda la ventana: los rebotes al apretar y al soltar se descartan aunque "
+                 "la presion dure mas que la ventana. En GPIOs que no se pueden leer desde la IRQ (expansores, "
+                 "gpio-sim) solo se ven las subidas y la ventana se cuenta desde la ultima");
+
+static unsigned int mesas[TRIVIA_MAX_MESAS];   ///< jugadores de cada mesa, se toman de botones= en orden
+static unsigned int nMesas;
+module_param_array(mesas, uint, &nMesas, S_IRUGO);
+MODULE_PARM_DESC(mesas, "Jugadores de cada mesa, en el orden de botones= (por defecto una sola mesa con todos)");
+
+#define TRIVIA_CUBETAS  24        ///< cubetas del histograma de reaccion, de 1us a 8s en potencias de 2
+
+/** @brief Estadisticas de un jugador, las actualiza solo su IRQ en O(1) por presion
+ *  El tiempo de reaccion se mide en las presiones con ronda armada (ganadas y tardias).
+ *  La cubeta i del histograma cuenta reacciones menores a 2^(i+10) ns (la ultima, todas las demas).
+ */
+struct trivia_estadisticas {
+   unsigned int gen;          ///< generacion de estadisticasGen de la mesa con la que se acumulo, si es vieja vale todo cero
+   u64 ganadas;               ///< rondas ganadas
+   u64 anticipadas;           ///< presiones con la ronda sin armar (salidas en falso)
+   u64 tardias;               ///< presiones despues del ganador o del plazo
+   u64 minNs;                 ///< reaccion minima
+   u64 maxNs;                 ///< reaccion maxima
+   u64 sumaNs;                ///< suma de reacciones, para el promedio
+   u64 histograma[TRIVIA_CUBETAS];
+};
+
+struct trivia_mesa;
+
+/** @brief Descriptor de cada jugador
+ *  Se pasa como dev_id al pedir la IRQ, asi un unico handler sabe quien apreto y en que mesa sin buscar.
+ *  Cada IRQ escribe el antirrebote, los rebotes y las estadisticas de su jugador: cada uno en sus
+ *  propias lineas de cache, asi dos botones vecinos en la tabla (de la misma mesa o de mesas distintas)
+ *  no se pisan la linea entre CPUs.
+ */
+struct trivia_jugador {
+   struct trivia_mesa *mesa;  ///< mesa en la que juega
+   unsigned int nro;          ///< nro de jugador dentro de su mesa a partir de 1, es el que se devuelve en read()
+   unsigned int gpioBoton;    ///< pulsador
+   unsigned int gpioRojo;     ///< led rojo
+   unsigned int gpioVerde;    ///< led verde
+   unsigned int gpioAzul;     ///< led azul
+   unsigned int irq;          ///< irq del pulsador
+   unsigned int antirreboteUs;   ///< ventana de antirrebote de este boton, la cambia el sysfs de su mesa
+   struct trivia_antirrebote antirrebote;   ///< ultimo flanco y si sigue apretado
+   unsigned long rebotes;     ///< subidas descartadas por el antirrebote
+   struct trivia_estadisticas est;   ///< estadisticas de reaccion
+   struct u64_stats_sync estSync;    ///< para leer est entera desde el sysfs en 32 bits
+} ____cacheline_aligned_in_smp;
+
+static struct trivia_jugador jugadores[TRIVIA_MAX_JUGADORES];  ///< tabla de jugadores de todas las mesas, en el orden de botones=
+static unsigned int nJugadores;                                ///< cantidad de jugadores preparados
+
+/** @brief Una mesa: un juego completo con sus jugadores, su ronda, su anillo y sus relojes
+ *  Cada mesa es un nro menor (/dev/trivialkmN) y llega a las file operations por private_data,
+ *  a las IRQs por el jugador y a los hrtimers y la work por container_of. Las mesas no comparten
+ *  nada en el camino de la presion: ni locks, ni contadores, ni la linea de cache (van alineadas).
+ */
+struct trivia_mesa {
+   unsigned int nro;                       ///< nro menor, el N de /dev/trivialkmN
+   struct trivia_jugador *jugadores;       ///< los de esta mesa, seguidos dentro de la tabla de jugadores
+   unsigned int nJugadores;                ///< cantidad de jugadores de la mesa
+   struct device *dev;                     ///< dispositivo, con sus atributos de sysfs
+   char message[256];                      ///< Memoria para la string de los mensajes de pregunta y respuesta hacia espaci de usaurio
+   int size_of_message;                    ///< Para el mensaje
+
+   // El estado de la ronda (la palabra atomica que reclaman las IRQs) y las reglas del juego estan en
+   // trivia_core.h; aca queda todo lo que toca hardware, relojes y al usuario.
+   struct trivia_core core;                ///< estado del juego
+   struct trivia_evento ganador;           ///< registro del ganador de la ultima ronda, para TRIVIA_IOC_RESULTADO
+   atomic_t ganadorPalabra;                ///< palabra de la ronda ganada a la que corresponde ganador
+   atomic_t numberPresses;                 ///< acumulador de botonazos, lo tocan IRQs de varias CPUs
+   atomic_t estadisticasGen;               ///< el reset la incrementa, cada IRQ pone en cero lo suyo al verla
+
+   // Banco de leds: todos los leds de la mesa en un solo arreglo de descriptores, tres por jugador, y
+   // su valor en una mascara de bits con el mismo orden (LED() de trivia_core.h). Cada cambio de estado
+   // es una sola escritura del arreglo; gpiolib la agrupa por controlador (set_multiple), asi la cantidad
+   // de accesos al bus no crece con los jugadores y no se ven estados intermedios entre un led y otro.
+   struct gpio_desc *ledsDesc[TRIVIA_MAX_LEDS];   ///< descriptores de los leds, en orden LED()
+   DECLARE_BITMAP(ledsActuales, TRIVIA_MAX_LEDS); ///< lo ultimo que se escribio, para no repetir
+   struct mutex ledsLock;                  ///< los leds se escriben desde el hilo de IRQ y desde open/read/release
+   atomic_t ledsPendientes;                ///< la parte rapida de la IRQ pide al hilo actualizar los leds
+
+   wait_queue_head_t espera;               ///< aca duermen los read() y poll() hasta que haya eventos
+                                           //la condicion (anillo no vacio) se re-chequea al despertar, asi
+                                           //una senal o un despertar espureo no devuelven basura, y una presion
+                                           //que llega antes de que el lector se duerma no se pierde
+   struct mutex lecturaLock;               ///< un solo lector a la vez arma y consume la ronda (read o ioctl)
+   struct mutex sesionLock;                ///< serializa arranque, fin y cola de la sesion, las aperturas y los armados fuera de sesion
+   unsigned int abiertos;                  ///< archivos abiertos de la mesa, con sesionLock
+
+   // Sesion: despues de cada ganador el driver espera revelar_ms (el usuario muestra la respuesta) y arma
+   // solo la ronda siguiente, mientras queden rondas en la cola. Lo hace un hrtimer programado desde la
+   // misma IRQ del ganador, asi entre ronda y ronda no hay syscalls ni procesos que despertar. El hrtimer
+   // corre en contexto de IRQ: arma, deja el evento y despierta; los leds, que pueden dormir, van en una work.
+   bool sesionActiva;                      ///< hay sesion, read() y TRIVIA_IOC_ARMAR no arman
+   u64 revelarNs;                          ///< espera entre el ganador y la ronda siguiente
+   atomic_t rondasEnCola;                  ///< rondas que quedan por armar
+   u64 plazoSesionNs;                      ///< plazo de cada ronda de la sesion, 0 sin plazo
+   struct hrtimer rearmeTimer;             ///< arma la ronda siguiente de la sesion
+   atomic64_t rearmeMaxNs;                 ///< peor atraso del hrtimer sobre el instante pedido
+   struct work_struct ledsWork;            ///< leds desde los hrtimers
+
+   // Plazo de la ronda: un solo hrtimer que se reprograma en cada armado. Cuando vence, la ronda pasa de
+   // ARMADA a VENCIDA con el mismo cmpxchg que usan las IRQs, asi entre un boton y el plazo gana uno solo.
+   struct hrtimer plazoTimer;              ///< vence la ronda armada sin ganador
 
-static unsigned int gpioBot1 = 60;   ///< tambien los botones pulsadores
-static unsigned int gpioBot2 = 61;   ///< 
+   // Animaciones (TRIVIA_IOC_ANIMAR): un solo hrtimer por mesa, en softirq, calcula el brillo de cada led
+   // y lo aproxima con PWM por software. Mientras corre es el unico que escribe los leds; los demas
+   // (todos con ledsLock) primero la paran con trivia_anim_parar(). La parte rapida de la IRQ de los
+   // botones no la toca y le puede ganar siempre: el hrtimer corre con las interrupciones habilitadas.
+   struct hrtimer animTimer;               ///< paso de la animacion y del PWM
+   unsigned int animacion;                 ///< TRIVIA_ANIM_* en curso, se escribe con ledsLock
+   u64 animInicio;                         ///< instante de arranque, las fases salen de aca
+   u64 animPeriodoNs;                      ///< duracion de un ciclo del patron
+   unsigned int animCiclos;                ///< ciclos a mostrar, 0 sin fin
+   unsigned int animNivel;                 ///< brillo maximo, en niveles de PWM
+   unsigned int animFase;                  ///< fase del PWM, avanza un nivel por paso
+   u64 animLeds;                           ///< leds que participan, mascara LED()
+   unsigned int animGanador;               ///< jugador que destella en TRIVIA_ANIM_GANADOR
+   unsigned int animParticipantes;         ///< jugadores con algun led en animLeds
+   u8 animOrden[TRIVIA_MAX_JUGADORES];     ///< esos jugadores, en orden, para TRIVIA_ANIM_CARRERA
+   bool ledsDuermen;                       ///< algun led esta en un controlador que puede dormir (I2C/SPI)
+   atomic64_t animMascara;                 ///< en ese caso el hrtimer deja aca lo que escribe animWork
+   struct work_struct animWork;            ///< escritura de la animacion en leds que pueden dormir
 
-static bool     Rojo1On = 0;		///< colores de los leds: azul=standby, verde=gano pulseada, rojo=perdio
-static bool     Rojo2On = 0;
-static bool     Verde1On = 0;
-static bool     Verde2On = 0;
-static bool     Azul1On = 0;
-static bool     Azul2On = 0;
+   // Costo de la parte rapida de la IRQ (desde que entra hasta que sale), para medir la latencia
+   // que le agregamos a los demas dispositivos de la placa
+   atomic64_t irqMaxNs;                    ///< el peor caso visto
+   atomic64_t irqTotalNs;                  ///< acumulado, para el promedio
+   atomic_t irqCuenta;                     ///< cantidad de IRQs medidas
+
+   // Anillo de eventos: cada IRQ deja un registro por presion, asi no se pierden los segundos puestos
+   // ni las presiones tardias aunque nadie este leyendo. Hay un productor por CPU posible, por eso cada
+   // ranura lleva su nro de secuencia y la reserva es un cmpxchg sobre anilloReserva (sin locks).
+   // De la cabecera mapeada solo se lee la cola, y siempre enmascarada con la capacidad de aca.
+   struct trivia_anillo *anillo;           ///< cabecera + ranuras, vmalloc_user para poder mapearlo
+   struct trivia_ranura *ranuras;          ///< ranuras, en la pagina siguiente a la cabecera
+   u32 capacidad;                          ///< ranuras del anillo, potencia de 2
+   atomic_t anilloReserva;                 ///< proxima posicion a reservar por los productores
+   atomic_t desbordes;                     ///< eventos descartados por anillo lleno
+} ____cacheline_aligned_in_smp;
+
+static struct trivia_mesa tablaMesas[TRIVIA_MAX_MESAS];   ///< las mesas, el indice es el nro menor
 
 
 
@@ -60,10 +240,13 @@ static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
 
-// y las de interrupcion
-static irq_handler_t triviaLKM_irq1_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t triviaLKM_irq2_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
+// y las de interrupcion, compartidas por todos los botones: la parte rapida y el hilo
+static irqreturn_t trivia_irq_rapida(int irq, void *dev_id);
+static irqreturn_t trivia_irq_hilo(int irq, void *dev_id);
 
 /** @brief Estructura de definicion de funciones a implementar
  *  definida en  /linux/fs.h 
@@ -71,17 +254,796 @@ static irq_handler_t triviaLKM_irq2_handler(unsigned int irq, void *dev_id, stru
  */
 static struct file_operations fops =
 {
-   .open = dev_open,	// prepara leds para inicio (standby)
-   .read = dev_read,	// lee tiempos de presion de los botones (no implementada aun)
+   .owner = THIS_MODULE,	// el modulo no se descarga mientras haya una mesa abierta
+   .open = dev_open,	// elige la mesa por el nro menor y prepara leds para inicio (standby)
+   .read = dev_read,	// arma la ronda y devuelve los eventos de presion (ganador, tiempos de reaccion)
    .write = dev_write,	// manda pregunta de trivia para mostrar por kern.log
+   .poll = dev_poll,	// avisa cuando hay eventos para leer, para usar con select/epoll
+   .mmap = dev_mmap,	// mapea el anillo de eventos para consumirlo sin copias
+   .unlocked_ioctl = dev_ioctl,	// control binario: armar ronda, leds, resultado, reset
+   .compat_ioctl = compat_ptr_ioctl,
    .release = dev_release, // apaga todo 
 };
 
-static struct task_struct *sleeping_task = NULL; 	//para despertar el read por interrupcion
-							//es un puntero a task_struct, lo uso para guardar el "current" 
-							//que es el puntero del kernel a la task_struct del 
-							//proceso que esta actualmente en ejecucion, o sea el que 
-							//invoco a este lkm
+/** @brief Encola un evento desde la IRQ
+ *  Si el anillo esta lleno el evento se descarta y se cuenta en desbordes, la IRQ nunca espera.
+ *  @return true si el evento quedo publicado
+ */
+static bool trivia_anillo_poner(struct trivia_mesa *m, const struct trivia_evento *ev){
+   int pos = atomic_read(&m->anilloReserva);
+   struct trivia_ranura *r;
+
+   // el cmpxchg solo falla si otro productor reservo antes, nunca se reintenta por lo que haya en la
+   // memoria mapeada: una cola fuera de rango (la escribe el usuario) da lleno
+   do {
+      if ((u32)pos - smp_load_acquire(&m->anillo->cola) >= m->capacidad){
+         WRITE_ONCE(m->anillo->desbordes, atomic_inc_return(&m->desbordes));   // lleno, el consumidor no la libero
+         return false;
+      }
+   } while (!atomic_try_cmpxchg(&m->anilloReserva, &pos, pos + 1));
+   r = &m->ranuras[pos & (m->capacidad - 1)];   // pos es nuestra y su vuelta anterior ya se consumio
+   r->ev = *ev;
+   smp_store_release(&r->seq, (u32)pos + 1);  // publicada
+   return true;
+}
+
+/** @brief La ranura de la cola tiene un evento publicado?
+ *  La cola la escribe el consumidor (tambien desde el usuario si mapeo el anillo), por eso
+ *  siempre se enmascara antes de indexar.
+ */
+static struct trivia_ranura *trivia_anillo_proxima(struct trivia_mesa *m){
+   u32 cola = READ_ONCE(m->anillo->cola);
+   struct trivia_ranura *r = &m->ranuras[cola & (m->capacidad - 1)];
+
+   return smp_load_acquire(&r->seq) == cola + 1 ? r : NULL;
+}
+
+/** @brief Libera la ranura de la cola despues de copiar su evento
+ *  Avanzar la cola alcanza, los productores miran la cola para saber si hay lugar.
+ */
+static void trivia_anillo_soltar(struct trivia_mesa *m){
+   smp_store_release(&m->anillo->cola, READ_ONCE(m->anillo->cola) + 1);
+}
+
+/** @brief Escribe los valores en el banco de leds de la mesa, si cambiaron
+ *  @param puedeDormir false solo desde el hrtimer de la animacion, con leds que no duermen
+ *  @return true si toco el bus
+ */
+static bool trivia_leds_volcar(struct trivia_mesa *m, unsigned long *valores, bool puedeDormir){
+   unsigned int n = 3 * m->nJugadores;
+
+   if (bitmap_equal(valores, m->ledsActuales, n))
+      return false;                         // nada cambio, no toco el bus
+   if (puedeDormir)
+      gpiod_set_array_value_cansleep(n, m->ledsDesc, NULL, valores);
+   else
+      gpiod_set_array_value(n, m->ledsDesc, NULL, valores);
+   bitmap_copy(m->ledsActuales, valores, TRIVIA_MAX_LEDS);
+   return true;
+}
+
+/** @brief Para la animacion de la mesa, si hay, con ledsLock tomado
+ *  Al volver el hrtimer no esta corriendo; una animWork pendiente ve animacion en cero y no escribe.
+ */
+static void trivia_anim_parar(struct trivia_mesa *m){
+   if (!m->animacion)
+      return;
+   WRITE_ONCE(m->animacion, TRIVIA_ANIM_NINGUNA);
+   hrtimer_cancel(&m->animTimer);
+}
+
+/** @brief Escribe el banco de leds de la mesa con la mascara, con ledsLock tomado
+ *  Puede dormir (expansores de GPIO por I2C/SPI), nunca se llama desde la parte rapida de la IRQ.
+ *  El juego le gana a la animacion: si habia una, se para.
+ */
+static void trivia_leds_escribir(struct trivia_mesa *m, u64 mascara, int palabra){
+   DECLARE_BITMAP(valores, TRIVIA_MAX_LEDS);
+
+   trivia_anim_parar(m);
+   bitmap_from_u64(valores, mascara);
+   if (trivia_leds_volcar(m, valores, true))
+      trace_trivia_leds(m->nro, valores, 3 * m->nJugadores, RONDA_NRO(palabra), RONDA_ESTADO(palabra));
+}
+
+/** @brief Lleva los leds al estado actual de la ronda
+ *  Se lee la palabra con el lock tomado, asi el hilo de IRQ y un read() que re-arma no se pisan
+ *  dejando los leds de una ronda vieja.
+ */
+static void trivia_leds(struct trivia_mesa *m){
+   int palabra;
+
+   mutex_lock(&m->ledsLock);
+   palabra = trivia_core_palabra(&m->core);
+   trivia_leds_escribir(m, trivia_core_leds(&m->core, palabra), palabra);
+   mutex_unlock(&m->ledsLock);
+}
+
+static void trivia_leds_work(struct work_struct *w){
+   trivia_leds(container_of(w, struct trivia_mesa, ledsWork));
+}
+
+/** @brief Brillo de un jugador de la animacion, de 0 a animNivel
+ *  @param fase ns desde el comienzo del ciclo actual
+ */
+static unsigned int trivia_anim_nivel(struct trivia_mesa *m, unsigned int jugador, u64 fase){
+   u64 periodo = m->animPeriodoNs, d;
+   unsigned int max = m->animNivel;
+
+   switch (m->animacion){
+   case TRIVIA_ANIM_PARPADEO:
+      return fase < periodo / 2 ? max : 0;
+   case TRIVIA_ANIM_PULSO:                  // triangulo: sube hasta la mitad del periodo y vuelve a bajar
+      d = 2 * fase > periodo ? 2 * fase - periodo : periodo - 2 * fase;
+      return div64_u64((u64)max * (periodo - d), periodo);
+   case TRIVIA_ANIM_CARRERA:                // cada jugador su parte del periodo, en orden
+      return m->animOrden[div64_u64(fase * m->animParticipantes, periodo)] == jugador ? max : 0;
+   default:                                 // TRIVIA_ANIM_GANADOR: cuatro destellos por periodo, el resto fijo
+      if (jugador != m->animGanador)
+         return max;
+      return div64_u64(fase * 8, periodo) & 1 ? 0 : max;
+   }
+}
+
+/** @brief Leds prendidos en este paso de la animacion
+ *  Un led con brillo b (de TRIVIA_PWM_NIVELES) esta prendido en b de cada TRIVIA_PWM_NIVELES pasos.
+ *  Con leds que pueden dormir no hay PWM (no se puede escribir a ese ritmo): se prende por encima de la
+ *  mitad del brillo maximo.
+ *  @param pwm sale en true si algun led quedo en un brillo intermedio y hace falta el paso corto
+ */
+static u64 trivia_anim_mascara(struct trivia_mesa *m, u64 fase, bool *pwm){
+   unsigned int umbral = m->ledsDuermen ? m->animNivel / 2 : m->animFase;
+   unsigned int i, j, nivel;
+   u64 mascara = 0;
+
+   for (i = 0; i < m->animParticipantes; i++){
+      j = m->animOrden[i];
+      nivel = trivia_anim_nivel(m, j, fase);
+      if (nivel > 0 && nivel < TRIVIA_PWM_NIVELES && !m->ledsDuermen)
+         *pwm = true;
+      if (nivel > umbral)
+         mascara |= m->animLeds & (7ULL << LED(j, LED_ROJO));   // los tres leds del jugador que participan
+   }
+   return mascara;
+}
+
+/** @brief Escritura de la animacion para leds que pueden dormir, el hrtimer dejo la mascara en animMascara */
+static void trivia_anim_work(struct work_struct *w){
+   struct trivia_mesa *m = container_of(w, struct trivia_mesa, animWork);
+   DECLARE_BITMAP(valores, TRIVIA_MAX_LEDS);
+
+   mutex_lock(&m->ledsLock);
+   if (m->animacion){                       // si el juego la paro mientras tanto, no piso sus leds
+      bitmap_from_u64(valores, atomic64_read(&m->animMascara));
+      trivia_leds_volcar(m, valores, true);
+   }
+   mutex_unlock(&m->ledsLock);
+}
+
+/** @brief Callback del hrtimer de la animacion, en softirq
+ *  Con algun brillo intermedio vuelve a vencer en un paso de PWM (625 us); si todo esta prendido o
+ *  apagado alcanza con un ciclo de PWM (10 ms). Al cumplir los ciclos pedidos los leds vuelven al juego.
+ */
+static enum hrtimer_restart trivia_anim_paso(struct hrtimer *t){
+   struct trivia_mesa *m = container_of(t, struct trivia_mesa, animTimer);
+   DECLARE_BITMAP(valores, TRIVIA_MAX_LEDS);
+   bool pwm = false;
+   u64 ciclo, fase, mascara;
+
+   if (!READ_ONCE(m->animacion))
+      return HRTIMER_NORESTART;
+   ciclo = div64_u64_rem(ktime_get_ns() - m->animInicio, m->animPeriodoNs, &fase);
+   if (m->animCiclos && ciclo >= m->animCiclos){
+      schedule_work(&m->ledsWork);          // trivia_leds la da por parada y muestra el juego
+      return HRTIMER_NORESTART;
+   }
+   mascara = trivia_anim_mascara(m, fase, &pwm);
+   m->animFase = (m->animFase + 1) % TRIVIA_PWM_NIVELES;
+   if (m->ledsDuermen){
+      atomic64_set(&m->animMascara, mascara);
+      schedule_work(&m->animWork);
+   } else {
+      bitmap_from_u64(valores, mascara);
+      trivia_leds_volcar(m, valores, false);
+   }
+   hrtimer_forward_now(t, ns_to_ktime(pwm ? TRIVIA_PWM_PASO_NS : TRIVIA_PWM_NIVELES * TRIVIA_PWM_PASO_NS));
+   return HRTIMER_RESTART;
+}
+
+/** @brief Arranca una animacion, o la para con TRIVIA_ANIM_NINGUNA (TRIVIA_IOC_ANIMAR y el sysfs)
+ *  Reemplaza a la que hubiera. TRIVIA_ANIM_GANADOR necesita una ronda ganada.
+ *  @return 0 si esta OK, -EINVAL o -ENOENT
+ */
+static int trivia_animar(struct trivia_mesa *m, const struct trivia_animar *a){
+   u32 validos = (1u << m->nJugadores) - 1;     // nJugadores <= 16
+   unsigned int j;
+   int palabra;
+
+   if (a->patron > TRIVIA_ANIM_GANADOR || a->brillo > 100 || a->reservado ||
+       (a->rojos | a->verdes | a->azules) & ~validos)
+      return -EINVAL;
+   if (a->patron == TRIVIA_ANIM_NINGUNA){
+      trivia_leds(m);                       // la para y vuelve a mostrar el juego
+      return 0;
+   }
+   mutex_lock(&m->ledsLock);
+   trivia_anim_parar(m);
+   palabra = trivia_core_palabra(&m->core);
+   if (a->patron == TRIVIA_ANIM_GANADOR){
+      if (RONDA_ESTADO(palabra) != TRIVIA_GANADA){
+         mutex_unlock(&m->ledsLock);
+         return -ENOENT;                    // no hay ganador en esta ronda
+      }
+      m->animGanador = RONDA_JUGADOR(palabra);
+      m->animLeds = trivia_core_leds(&m->core, palabra);   // los leds de la ronda ganada
+   } else if (a->rojos | a->verdes | a->azules){
+      m->animLeds = trivia_core_leds_manual(&m->core, a->rojos, a->verdes, a->azules);
+   } else {
+      m->animLeds = trivia_core_leds_manual(&m->core, validos, validos, validos);
+   }
+   m->animParticipantes = 0;
+   for (j = 1; j <= m->nJugadores; j++)
+      if (m->animLeds & (7ULL << LED(j, LED_ROJO)))
+         m->animOrden[m->animParticipantes++] = j;
+   m->animPeriodoNs = (u64)(a->periodo_ms ? a->periodo_ms : 1000) * NSEC_PER_MSEC;
+   m->animCiclos = a->ciclos;
+   m->animNivel = a->brillo ? DIV_ROUND_UP(a->brillo * TRIVIA_PWM_NIVELES, 100) : TRIVIA_PWM_NIVELES;
+   m->animFase = 0;
+   m->animInicio = ktime_get_ns();
+   WRITE_ONCE(m->animacion, a->patron);
+   hrtimer_start(&m->animTimer, ns_to_ktime(m->animInicio), HRTIMER_MODE_ABS_SOFT);
+   mutex_unlock(&m->ledsLock);
+   return 0;
+}
+
+/** @brief Libera los recursos de los primeros n jugadores
+ *  se usa en la salida del modulo y para deshacer un init que fallo a mitad de camino
+ */
+static void trivia_liberar(unsigned int n){
+   while (n--){
+      struct trivia_jugador *j = &jugadores[n];
+
+      free_irq(j->irq, j);                  // libero la irq solicitada
+      gpio_unexport(j->gpioRojo);           // desconecto del sysfs
+      gpio_unexport(j->gpioVerde);
+      gpio_unexport(j->gpioAzul);
+      gpio_unexport(j->gpioBoton);
+      gpio_free(j->gpioRojo);               // libero leds
+      gpio_free(j->gpioVerde);
+      gpio_free(j->gpioAzul);
+      gpio_free(j->gpioBoton);              // libero el boton
+   }
+}
+
+/** @brief Reserva pines e irq de un jugador
+ *  @return 0 si esta OK, o el error y el jugador queda sin nada reservado
+ */
+static int trivia_preparar(struct trivia_jugador *j){
+   struct trivia_mesa *m = j->mesa;
+   int result;
+
+   // le pedimos al sysfs el mapeo de los leds y el boton
+   result = gpio_request(j->gpioRojo, "sysfs");
+   if (result)
+      goto err_rojo;
+   result = gpio_request(j->gpioVerde, "sysfs");
+   if (result)
+      goto err_verde;
+   result = gpio_request(j->gpioAzul, "sysfs");
+   if (result)
+      goto err_azul;
+   result = gpio_request(j->gpioBoton, "sysfs");
+   if (result)
+      goto err_boton;
+
+   gpio_direction_output(j->gpioRojo, false);   // los leds como salida y estado inicial (off)
+   gpio_direction_output(j->gpioVerde, false);
+   gpio_direction_output(j->gpioAzul, false);
+   gpio_direction_input(j->gpioBoton);          // el boton como entrada
+
+   gpio_export(j->gpioRojo, false);             // hace gpioXX aparecer en /sys/class/gpio
+   gpio_export(j->gpioVerde, false);            // el argumento bool = false hace que no se pueda cambiar la direccion
+   gpio_export(j->gpioAzul, false);
+   gpio_export(j->gpioBoton, false);
+
+   // los leds al banco de su mesa, en la posicion de su bit en las mascaras del nucleo
+   m->ledsDesc[LED(j->nro, LED_ROJO)]  = gpio_to_desc(j->gpioRojo);
+   m->ledsDesc[LED(j->nro, LED_VERDE)] = gpio_to_desc(j->gpioVerde);
+   m->ledsDesc[LED(j->nro, LED_AZUL)]  = gpio_to_desc(j->gpioAzul);
+   if (gpiod_cansleep(m->ledsDesc[LED(j->nro, LED_ROJO)]) || gpiod_cansleep(m->ledsDesc[LED(j->nro, LED_VERDE)]) ||
+       gpiod_cansleep(m->ledsDesc[LED(j->nro, LED_AZUL)]))
+      m->ledsDuermen = true;                // las animaciones escriben desde una work y sin PWM
+
+   // como los nros de GPIO e IRQ no son coincidentes, los pedimos con una funcion de mapeo
+   result = gpio_to_irq(j->gpioBoton);
+   if (result < 0)
+      goto err_irq;
+   j->irq = result;
+
+   // el antirrebote necesita ver la suelta: los dos flancos, con el nivel leido en la parte rapida.
+   // Si la linea no se puede leer desde la IRQ (expansor, gpio-sim) quedan solo las subidas
+   trivia_core_antirrebote_iniciar(&j->antirrebote, !gpio_cansleep(j->gpioBoton));
+   result = request_threaded_irq(j->irq,    // la irq pedida
+                        trivia_irq_rapida,     // parte rapida: solo tiempo, arbitraje y evento
+                        trivia_irq_hilo,       // hilo: leds, log y despertar al lector
+                        j->antirrebote.dosFlancos ? IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING : IRQF_TRIGGER_RISING,
+                        "trivia_gpio_handler",    // en /proc/interrupts para identificar al propietario
+                        j);                    // el *dev_id es el jugador, asi el handler no tiene que buscarlo
+   if (result)
+      goto err_irq;
+
+   printk(KERN_INFO "triviaLKM: mesa %d Boton%d en GPIO %d, IRQ: %d\n", m->nro, j->nro, j->gpioBoton, j->irq);
+   return 0;
+
+err_irq:
+   gpio_unexport(j->gpioRojo);
+   gpio_unexport(j->gpioVerde);
+   gpio_unexport(j->gpioAzul);
+   gpio_unexport(j->gpioBoton);
+   gpio_free(j->gpioBoton);
+err_boton:
+   gpio_free(j->gpioAzul);
+err_azul:
+   gpio_free(j->gpioVerde);
+err_verde:
+   gpio_free(j->gpioRojo);
+err_rojo:
+   printk(KERN_ALERT "triviaLKM: falla al preparar el jugador %d de la mesa %d: %d\n", j->nro, m->nro, result);
+   return result;
+}
+
+/** @brief Arma una ronda nueva con el nucleo y programa su plazo
+ *  Se llama desde read() y TRIVIA_IOC_ARMAR (con trivia_armar_sin_sesion) o desde el hrtimer de la
+ *  sesion, nunca dos a la vez en la misma mesa.
+ *  @param plazo ns para apretar, 0 sin plazo
+ *  @return la palabra nueva
+ */
+static int trivia_armar(struct trivia_mesa *m, unsigned int nro, u64 plazo){
+   int nuevo;
+
+   // el resultado anterior ya no vale, aunque el usuario vuelva a pedir un nro de ronda que ya uso;
+   // se borra antes de publicar la ronda, asi no puede pisar al ganador de la nueva
+   atomic_set(&m->ganadorPalabra, RONDA_PALABRA(0, 0, TRIVIA_LIBRE));
+   nuevo = trivia_core_armar(&m->core, nro, ktime_get_ns(), plazo);
+
+   if (plazo)
+      hrtimer_start(&m->plazoTimer, ns_to_ktime(m->core.tVence), HRTIMER_MODE_ABS);
+   return nuevo;
+}
+
+/** @brief Arma una ronda fuera de sesion, para read() y TRIVIA_IOC_ARMAR
+ *  Con sesionLock, el mismo que arranca la sesion: o la sesion ya esta activa y arma solo su hrtimer,
+ *  o no arranca hasta que este armado termine. Asi nunca hay dos armadores a la vez en la mesa.
+ *  @param nro nro de la ronda, 0 para la siguiente a la actual
+ *  @return el nro de la ronda armada, -EBUSY en sesion o -EINVAL si nro es el de la ronda actual
+ */
+static int trivia_armar_sin_sesion(struct trivia_mesa *m, unsigned int nro, u64 plazo){
+   unsigned int actual;
+   int ret;
+
+   mutex_lock(&m->sesionLock);
+   actual = RONDA_NRO(trivia_core_palabra(&m->core));
+   if (m->sesionActiva)
+      ret = -EBUSY;                            // en sesion arma el hrtimer
+   else if (nro == actual)
+      ret = -EINVAL;
+   else
+      ret = RONDA_NRO(trivia_armar(m, nro ? nro : trivia_core_siguiente(actual), plazo));
+   mutex_unlock(&m->sesionLock);
+   return ret;
+}
+
+/** @brief Hay resultado (ganador o vencimiento) publicado para la ronda nro? */
+static bool trivia_hay_ganador(struct trivia_mesa *m, unsigned int nro){
+   int palabra = atomic_read_acquire(&m->ganadorPalabra);
+
+   return trivia_core_cerrada(palabra) && RONDA_NRO(palabra) == nro;
+}
+
+/** @brief Acumula la presion en las estadisticas del jugador, desde la parte rapida de la IRQ
+ *  Sin divisiones ni locks: el promedio se calcula al leer y la cubeta sale de fls64().
+ */
+static void trivia_estadistica(struct trivia_jugador *j, const struct trivia_evento *ev){
+   struct trivia_estadisticas *e = &j->est;
+   unsigned int gen = atomic_read(&j->mesa->estadisticasGen);
+   int cubeta;
+
+   u64_stats_update_begin(&j->estSync);
+   if (e->gen != gen){                      // hubo reset desde la ultima presion
+      memset(e, 0, sizeof(*e));
+      e->minNs = U64_MAX;
+      e->gen = gen;
+   }
+   if (ev->flags & TRIVIA_EVF_ANTICIPADA){
+      e->anticipadas++;
+   } else {
+      if (ev->tipo == TRIVIA_EV_GANADOR)
+         e->ganadas++;
+      else
+         e->tardias++;
+      e->minNs = min(e->minNs, ev->delta_ns);
+      e->maxNs = max(e->maxNs, ev->delta_ns);
+      e->sumaNs += ev->delta_ns;
+      cubeta = clamp(fls64(ev->delta_ns) - 10, 0, TRIVIA_CUBETAS - 1);
+      e->histograma[cubeta]++;
+   }
+   u64_stats_update_end(&j->estSync);
+}
+
+/** @brief Copia las estadisticas de un jugador, para el sysfs
+ *  Si son de una generacion anterior al ultimo reset de su mesa se devuelven en cero.
+ */
+static void trivia_estadisticas_leer(struct trivia_jugador *j, struct trivia_estadisticas *copia){
+   unsigned int inicio;
+
+   do {
+      inicio = u64_stats_fetch_begin(&j->estSync);
+      *copia = j->est;
+   } while (u64_stats_fetch_retry(&j->estSync, inicio));
+   if (copia->gen != (unsigned int)atomic_read(&j->mesa->estadisticasGen))
+      memset(copia, 0, sizeof(*copia));
+   else if (copia->minNs == U64_MAX)
+      copia->minNs = 0;                     // solo anticipadas, sin reacciones medidas
+}
+
+/** @brief Pone en cero los contadores de la mesa (TRIVIA_IOC_RESET)
+ *  Los de cada jugador los escribe solo su IRQ; una presion justo durante el reset puede
+ *  quedar contada o no, es informativo.
+ */
+static void trivia_reset_contadores(struct trivia_mesa *m){
+   unsigned int i;
+
+   atomic_set(&m->numberPresses, 0);
+   atomic_set(&m->desbordes, 0);
+   WRITE_ONCE(m->anillo->desbordes, 0);
+   atomic64_set(&m->irqMaxNs, 0);
+   atomic64_set(&m->irqTotalNs, 0);
+   atomic_set(&m->irqCuenta, 0);
+   atomic64_set(&m->rearmeMaxNs, 0);
+   for (i = 0; i < m->nJugadores; i++)
+      WRITE_ONCE(m->jugadores[i].rebotes, 0);
+   atomic_inc(&m->estadisticasGen);         // las de cada jugador las pone en cero su IRQ
+}
+
+/** @brief Programa el armado de la proxima ronda de la sesion
+ *  Se llama tambien desde la parte rapida de la IRQ; si no hay sesion o la cola esta vacia
+ *  no hace nada, y si el instante ya paso el hrtimer vence enseguida.
+ *  @param cuando instante de armado, CLOCK_MONOTONIC en ns
+ */
+static void trivia_sesion_programar(struct trivia_mesa *m, u64 cuando){
+   if (READ_ONCE(m->sesionActiva) && atomic_read(&m->rondasEnCola) > 0)
+      hrtimer_start(&m->rearmeTimer, ns_to_ktime(cuando), HRTIMER_MODE_ABS);
+}
+
+/** @brief Retoma la sesion despues de cargar la cola
+ *  Con una ronda en juego no hace falta: la programa la IRQ del ganador. Si ya hubo ganador se
+ *  respeta lo que falta de revelar_ms; si no (recien arrancada) se arma enseguida.
+ */
+static void trivia_sesion_seguir(struct trivia_mesa *m){
+   int palabra = trivia_core_palabra(&m->core);
+
+   if (RONDA_ESTADO(palabra) == TRIVIA_ARMADA)
+      return;
+   if (trivia_core_cerrada(palabra) && trivia_hay_ganador(m, RONDA_NRO(palabra)))
+      trivia_sesion_programar(m, READ_ONCE(m->ganador.t_ns) + READ_ONCE(m->revelarNs));
+   else
+      trivia_sesion_programar(m, ktime_get_ns());
+}
+
+/** @brief Termina la sesion, con sesionLock tomado
+ *  Al volver el hrtimer no esta corriendo; si una IRQ en vuelo lo reprograma, vence sin armar.
+ */
+static void trivia_sesion_terminar(struct trivia_mesa *m){
+   WRITE_ONCE(m->sesionActiva, false);
+   hrtimer_cancel(&m->rearmeTimer);
+   atomic_set(&m->rondasEnCola, 0);
+}
+
+/** @brief Callback del hrtimer de la sesion, en contexto de IRQ
+ *  Arma la ronda siguiente si quedan en la cola, la anuncia con un TRIVIA_EV_ARMADA y despierta
+ *  al lector. Lo que tarda en vencer respecto del instante pedido queda en rearme_max_ns.
+ */
+static enum hrtimer_restart trivia_rearme(struct hrtimer *t){
+   struct trivia_mesa *m = container_of(t, struct trivia_mesa, rearmeTimer);
+   s64 atraso = ktime_get_ns() - ktime_to_ns(hrtimer_get_expires(t));
+   int palabra = trivia_core_palabra(&m->core);
+   struct trivia_evento ev = {
+      .version = TRIVIA_ABI_VERSION,
+      .tipo    = TRIVIA_EV_ARMADA,
+      .largo   = sizeof(ev),
+   };
+   s64 max;
+
+   // en sesion solo arma este hrtimer, y la IRQ solo saca a la ronda de ARMADA: no hay carrera
+   if (!READ_ONCE(m->sesionActiva) || RONDA_ESTADO(palabra) == TRIVIA_ARMADA)
+      return HRTIMER_NORESTART;
+   if (atomic_dec_if_positive(&m->rondasEnCola) < 0)
+      return HRTIMER_NORESTART;              // cola vacia, TRIVIA_IOC_ENCOLAR lo vuelve a programar
+   palabra = trivia_armar(m, trivia_core_siguiente(RONDA_NRO(palabra)), READ_ONCE(m->plazoSesionNs));
+   ev.ronda = RONDA_NRO(palabra);
+   ev.t_ns  = m->core.tArmado;
+   trivia_anillo_poner(m, &ev);
+   schedule_work(&m->ledsWork);
+   trace_trivia_despertar(m->nro, 0);
+   wake_up_interruptible(&m->espera);
+
+   max = atomic64_read(&m->rearmeMaxNs);
+   while (atraso > max && !atomic64_try_cmpxchg(&m->rearmeMaxNs, &max, atraso))
+      ;
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Callback del hrtimer del plazo, en contexto de IRQ
+ *  Si la ronda sigue armada la cierra como VENCIDA (trivia_core_vencer), deja el TRIVIA_EV_VENCIDA
+ *  como resultado de la ronda, pasa los leds a todos rojos y despierta a read() y a TRIVIA_IOC_RESULTADO.
+ */
+static enum hrtimer_restart trivia_vencer(struct hrtimer *t){
+   struct trivia_mesa *m = container_of(t, struct trivia_mesa, plazoTimer);
+   u64 ahora = ktime_get_ns();
+   struct trivia_evento ev;
+   int vencida = trivia_core_vencer(&m->core, ahora, &ev);
+
+   if (!vencida)
+      return HRTIMER_NORESTART;             // un boton llego antes, se re-armo, o no es su plazo
+   m->ganador = ev;                         // ninguna IRQ lo escribe: la ronda ya no esta armada
+   atomic_set_release(&m->ganadorPalabra, vencida);
+   trivia_anillo_poner(m, &ev);
+   schedule_work(&m->ledsWork);
+   trace_trivia_despertar(m->nro, 0);
+   wake_up_interruptible(&m->espera);
+   trivia_sesion_programar(m, ahora + READ_ONCE(m->revelarNs));   // en sesion, sigue con la proxima
+   return HRTIMER_NORESTART;
+}
+
+// Atributos de cada mesa en /sys/class/fslkm/trivialkmN/, la mesa es el drvdata del dispositivo
+
+static ssize_t presiones_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%d\n", atomic_read(&m->numberPresses));
+}
+static DEVICE_ATTR_RO(presiones);     ///< cantidad de interrupciones de los botones
+
+static ssize_t desbordes_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%d\n", atomic_read(&m->desbordes));
+}
+static DEVICE_ATTR_RO(desbordes);     ///< eventos perdidos porque el anillo estaba lleno
+
+static ssize_t irq_max_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&m->irqMaxNs));
+}
+static DEVICE_ATTR_RO(irq_max_ns);    ///< peor costo de la parte rapida de la IRQ
+
+static ssize_t irq_prom_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   int cuenta = atomic_read(&m->irqCuenta);
+
+   return sysfs_emit(buf, "%llu\n", cuenta ? div_u64(atomic64_read(&m->irqTotalNs), cuenta) : 0);
+}
+static DEVICE_ATTR_RO(irq_prom_ns);   ///< costo promedio de la parte rapida de la IRQ
+
+static ssize_t antirrebote_us_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   unsigned int i;
+   int n = 0;
+
+   for (i = 0; i < m->nJugadores; i++)  // uno por jugador de la mesa, como rebotes
+      n += sysfs_emit_at(buf, n, "%s%u", i ? " " : "", READ_ONCE(m->jugadores[i].antirreboteUs));
+   return n + sysfs_emit_at(buf, n, "\n");
+}
+/** @brief Un valor para todos los jugadores de la mesa, o uno por jugador en orden */
+static ssize_t antirrebote_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   unsigned int us[TRIVIA_MAX_JUGADORES], n = 0, i;
+   const char *p = buf;
+   int largo;
+
+   while (n < m->nJugadores && sscanf(p, "%u%n", &us[n], &largo) == 1){
+      n++;
+      p += largo;
+   }
+   if (*skip_spaces(p) || (n != 1 && n != m->nJugadores))
+      return -EINVAL;
+   for (i = 0; i < m->nJugadores; i++)
+      WRITE_ONCE(m->jugadores[i].antirreboteUs, us[n == 1 ? 0 : i]);   // la IRQ lo lee en cada flanco
+   return count;
+}
+static DEVICE_ATTR_RW(antirrebote_us);   ///< ventana de antirrebote de cada jugador de la mesa
+
+static ssize_t rebotes_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   unsigned int i;
+   int n = 0;
+
+   for (i = 0; i < m->nJugadores; i++)  // uno por jugador de la mesa, en el orden de botones=
+      n += sysfs_emit_at(buf, n, "%s%lu", i ? " " : "", READ_ONCE(m->jugadores[i].rebotes));
+   return n + sysfs_emit_at(buf, n, "\n");
+}
+static DEVICE_ATTR_RO(rebotes);          ///< subidas descartadas por el antirrebote, por jugador
+
+static ssize_t rondas_en_cola_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%d\n", atomic_read(&m->rondasEnCola));
+}
+static DEVICE_ATTR_RO(rondas_en_cola);   ///< rondas de la sesion que faltan armar
+
+static ssize_t rearme_max_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&m->rearmeMaxNs));
+}
+static DEVICE_ATTR_RO(rearme_max_ns);    ///< peor atraso del re-armado de la sesion
+
+static const char * const trivia_anim_nombres[] = { "ninguna", "parpadeo", "pulso", "carrera", "ganador" };   ///< por TRIVIA_ANIM_*
+
+static ssize_t animacion_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+
+   return sysfs_emit(buf, "%s\n", trivia_anim_nombres[READ_ONCE(m->animacion)]);
+}
+static ssize_t animacion_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct trivia_animar a = { 0 };          // periodo, brillo y leds por defecto, sin fin
+   int patron = sysfs_match_string(trivia_anim_nombres, buf);
+   int err;
+
+   if (patron < 0)
+      return patron;
+   a.patron = patron;
+   err = trivia_animar(dev_get_drvdata(dev), &a);
+   return err ? err : count;
+}
+static DEVICE_ATTR_RW(animacion);        ///< animacion en curso; escribir el nombre de un patron lo arranca con los valores por defecto
+
+// Estadisticas por jugador en /sys/class/fslkm/trivialkmN/estadisticas/, un valor por jugador de la
+// mesa por linea en el orden de botones= (como rebotes), el histograma una linea por jugador
+
+enum { EST_GANADAS, EST_ANTICIPADAS, EST_TARDIAS, EST_MIN, EST_PROM, EST_MAX };
+
+static ssize_t trivia_est_show(struct device *dev, struct device_attribute *attr, char *buf){
+   int cual = (long)container_of(attr, struct dev_ext_attribute, attr)->var;
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   struct trivia_estadisticas e;
+   unsigned int i;
+   u64 medidas, v;
+   int n = 0;
+
+   for (i = 0; i < m->nJugadores; i++){
+      trivia_estadisticas_leer(&m->jugadores[i], &e);
+      medidas = e.ganadas + e.tardias;
+      switch (cual){
+      case EST_GANADAS:     v = e.ganadas; break;
+      case EST_ANTICIPADAS: v = e.anticipadas; break;
+      case EST_TARDIAS:     v = e.tardias; break;
+      case EST_MIN:         v = e.minNs; break;
+      case EST_PROM:        v = medidas ? div64_u64(e.sumaNs, medidas) : 0; break;
+      default:              v = e.maxNs; break;
+      }
+      n += sysfs_emit_at(buf, n, "%s%llu", i ? " " : "", v);
+   }
+   return n + sysfs_emit_at(buf, n, "\n");
+}
+
+#define TRIVIA_EST_ATTR(_nombre, _cual) \
+   static struct dev_ext_attribute dev_attr_##_nombre = { __ATTR(_nombre, S_IRUGO, trivia_est_show, NULL), (void *)(_cual) }
+
+TRIVIA_EST_ATTR(ganadas, EST_GANADAS);              ///< rondas ganadas
+TRIVIA_EST_ATTR(anticipadas, EST_ANTICIPADAS);      ///< salidas en falso, con la ronda sin armar
+TRIVIA_EST_ATTR(tardias, EST_TARDIAS);              ///< presiones despues de cerrada la ronda
+TRIVIA_EST_ATTR(reaccion_min_ns, EST_MIN);
+TRIVIA_EST_ATTR(reaccion_prom_ns, EST_PROM);
+TRIVIA_EST_ATTR(reaccion_max_ns, EST_MAX);
+
+static ssize_t histograma_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct trivia_mesa *m = dev_get_drvdata(dev);
+   struct trivia_estadisticas e;
+   unsigned int i, c;
+   int n = 0;
+
+   for (i = 0; i < m->nJugadores; i++){
+      trivia_estadisticas_leer(&m->jugadores[i], &e);
+      for (c = 0; c < TRIVIA_CUBETAS; c++)
+         n += sysfs_emit_at(buf, n, "%s%llu", c ? " " : "", e.histograma[c]);
+      n += sysfs_emit_at(buf, n, "\n");
+   }
+   return n;
+}
+static DEVICE_ATTR_RO(histograma);       ///< reacciones por cubeta, la cubeta c son las menores a 2^(c+10) ns
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   trivia_reset_contadores(dev_get_drvdata(dev));   // lo mismo que TRIVIA_IOC_RESET
+   return count;
+}
+static DEVICE_ATTR_WO(reset);            ///< escribir cualquier cosa pone en cero estadisticas y contadores de la mesa
+
+static struct attribute *trivia_est_attrs[] = {
+   &dev_attr_ganadas.attr.attr,
+   &dev_attr_anticipadas.attr.attr,
+   &dev_attr_tardias.attr.attr,
+   &dev_attr_reaccion_min_ns.attr.attr,
+   &dev_attr_reaccion_prom_ns.attr.attr,
+   &dev_attr_reaccion_max_ns.attr.attr,
+   &dev_attr_histograma.attr,
+   &dev_attr_reset.attr,
+   NULL,
+};
+
+static struct attribute *trivia_attrs[] = {
+   &dev_attr_presiones.attr,
+   &dev_attr_desbordes.attr,
+   &dev_attr_irq_max_ns.attr,
+   &dev_attr_irq_prom_ns.attr,
+   &dev_attr_antirrebote_us.attr,
+   &dev_attr_rebotes.attr,
+   &dev_attr_rondas_en_cola.attr,
+   &dev_attr_rearme_max_ns.attr,
+   &dev_attr_animacion.attr,
+   NULL,
+};
+static const struct attribute_group trivia_group = {
+   .attrs = trivia_attrs,
+};
+static const struct attribute_group trivia_est_group = {
+   .name  = "estadisticas",
+   .attrs = trivia_est_attrs,
+};
+static const struct attribute_group *trivia_groups[] = {
+   &trivia_group,
+   &trivia_est_group,
+   NULL,
+};
+
+/** @brief Inicializa una mesa con sus jugadores (todavia sin pines) y le reserva el anillo
+ *  @param primero indice en la tabla de jugadores de su primer jugador
+ *  @return 0 si esta OK, o -ENOMEM
+ */
+static int trivia_mesa_iniciar(struct trivia_mesa *m, unsigned int nro, unsigned int primero, unsigned int n){
+   unsigned int i;
+
+   m->nro        = nro;
+   m->jugadores  = &jugadores[primero];
+   m->nJugadores = n;
+   for (i = 0; i < n; i++){
+      m->jugadores[i].mesa = m;
+      m->jugadores[i].nro  = i + 1;        // los nros de jugador empiezan en 1 en cada mesa
+   }
+   mutex_init(&m->ledsLock);
+   mutex_init(&m->lecturaLock);
+   mutex_init(&m->sesionLock);
+   init_waitqueue_head(&m->espera);
+   INIT_WORK(&m->ledsWork, trivia_leds_work);
+   INIT_WORK(&m->animWork, trivia_anim_work);
+   // la animacion en softirq (_SOFT): no es urgente y no tiene por que correr con las IRQs deshabilitadas
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+   hrtimer_setup(&m->rearmeTimer, trivia_rearme, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   hrtimer_setup(&m->plazoTimer, trivia_vencer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   hrtimer_setup(&m->animTimer, trivia_anim_paso, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+#else
+   hrtimer_init(&m->rearmeTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   m->rearmeTimer.function = trivia_rearme;
+   hrtimer_init(&m->plazoTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   m->plazoTimer.function = trivia_vencer;
+   hrtimer_init(&m->animTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+   m->animTimer.function = trivia_anim_paso;
+#endif
+   // arrancamos con todo apagado y los botones sin contar
+   trivia_core_iniciar(&m->core, n);
+
+   // el anillo va antes que el dispositivo, asi ni read() ni mmap() lo ven sin inicializar
+   // la cabecera sola en su pagina, asi se puede mapear con escritura sin exponer las ranuras
+   m->anillo = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(eventos * sizeof(struct trivia_ranura)));   // ya en cero
+   if (!m->anillo)
+      return -ENOMEM;
+   m->capacidad         = eventos;
+   m->anillo->version   = TRIVIA_ABI_VERSION;
+   m->anillo->capacidad = eventos;
+   m->anillo->ranuras   = PAGE_SIZE;
+   m->ranuras = (struct trivia_ranura *)((char *)m->anillo + PAGE_SIZE);
+   return 0;
+}
 
 /** @brief Funcion de inicializacion del LKM
  *  El "static" restringe la visibilidad de la funcion dentro de este fuente. La macro __init
@@ -92,195 +1054,198 @@ static struct task_struct *sleeping_task = NULL; 	//para despertar el read por i
 static int __init trivia_init(void){
   
    int result = 0; // para recoger el resultado de los pedidos de regreso de las IRQs
+   unsigned int i, suma, creados = 0;
   
    printk(KERN_INFO "TriviaLKM: Inicializando TriviaDriver...\n");
 
-   // tratamos de determinar un MAJOR number automaticamente 
+   // cada boton necesita sus tres leds
+   if (nBotones == 0 || nRojos != nBotones || nVerdes != nBotones || nAzules != nBotones){
+      printk(KERN_ALERT "TriviaLKM: hacen falta tantos leds rojos, verdes y azules como botones\n");
+      return -EINVAL;
+   }
+   if (!is_power_of_2(eventos) || eventos > TRIVIA_MAX_EVENTOS){
+      printk(KERN_ALERT "TriviaLKM: la capacidad del anillo de eventos debe ser potencia de 2, hasta %u\n", TRIVIA_MAX_EVENTOS);
+      return -EINVAL;
+   }
+   // sin mesas= una sola mesa con todos los botones, como siempre
+   if (nMesas == 0){
+      mesas[0] = nBotones;
+      nMesas = 1;
+   }
+   for (i = 0, suma = 0; i < nMesas; i++){
+      if (mesas[i] == 0){
+         printk(KERN_ALERT "TriviaLKM: la mesa %d no tiene jugadores\n", i);
+         return -EINVAL;
+      }
+      suma += mesas[i];
+   }
+   if (suma != nBotones){
+      printk(KERN_ALERT "TriviaLKM: las mesas suman %d jugadores y hay %d botones\n", suma, nBotones);
+      return -EINVAL;
+   }
+
+   for (i = 0, suma = 0; i < nMesas; suma += mesas[i++]){
+      result = trivia_mesa_iniciar(&tablaMesas[i], i, suma, mesas[i]);
+      if (result)
+         goto err_anillos;
+   }
+
+   // ahora vamos a reservar recursos de hardware en la funcion de init porque seran de uso exclusivo,
+   // antes de registrar el dispositivo: un open() (de udev o de quien sea) ya encuentra los pines, las
+   // IRQs y el banco de leds de su mesa completos, y si algo falla no hay ningun archivo abierto
+   //
+   // un boton con su irq y tres leds por jugador, todos descriptos en la tabla de jugadores
+   // se chequea con la funcion gpio_is_valid(nro de gpio) que se pueda usar cada pin
+   
+   // el antirrebote es por software en la IRQ (antirrebote_us de cada boton), gpio_set_debounce no esta en todos los controladores
+
+   for (nJugadores = 0; nJugadores < nBotones; nJugadores++){
+      struct trivia_jugador *j = &jugadores[nJugadores];
+      j->gpioBoton = botones[nJugadores];
+      j->gpioRojo  = rojos[nJugadores];
+      j->gpioVerde = verdes[nJugadores];
+      j->gpioAzul  = azules[nJugadores];
+      // antes de pedir la IRQ; sin valor para este boton vale el ultimo que se dio
+      j->antirreboteUs = nAntirrebote ? antirrebote_us[min(nJugadores, nAntirrebote - 1)] : 5000;
+      u64_stats_init(&j->estSync);
+      if (!gpio_is_valid(j->gpioBoton) || !gpio_is_valid(j->gpioRojo) ||
+          !gpio_is_valid(j->gpioVerde) || !gpio_is_valid(j->gpioAzul)){
+         printk(KERN_ALERT "triviaLKM: pin invalido para el jugador %d de la mesa %d\n", j->nro, j->mesa->nro);
+         result = -EINVAL;
+         goto err_jugadores;
+      }
+      result = trivia_preparar(j);
+      if (result)
+         goto err_jugadores;
+   }
+   printk(KERN_INFO "triviaLKM: %d jugadores listos en %d mesas\n", nJugadores, nMesas);
+
+   // tratamos de determinar un MAJOR number automaticamente, con un nro menor por mesa
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
       printk(KERN_ALERT "TriviaLKM falla al intentar registrar nro mayor\n");
-      return majorNumber;
+      result = majorNumber;
+      goto err_jugadores;
    }
    printk(KERN_INFO "TriviaLKM: registrado correctamente con nro mayor %d\n", majorNumber);
 
    // registramos la calss del dispositivo
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+   triviaClass = class_create(CLASS_NAME);             // desde 6.4 ya no lleva el modulo
+#else
    triviaClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
    if (IS_ERR(triviaClass)){                // chequeo de error y cleanup si falla
-      unregister_chrdev(majorNumber, DEVICE_NAME);
       printk(KERN_ALERT "Failed to register device class\n");
-      return PTR_ERR(triviaClass);          // forma correcta de devolver un puntero como error
+      result = PTR_ERR(triviaClass);        // forma correcta de devolver un puntero como error
+      goto err_chrdev;
    }
    printk(KERN_INFO "TriviaLKM: clase de dispositivo registrada correctamente\n");
 
-   // Register the device driver
-   triviaDevice = device_create(triviaClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(triviaDevice)){               // chequeo de error y cleanup si falla
-      class_destroy(triviaClass);           // este codigo se repite pero la alternativa es hacer goto....en fin
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "falla al crear el dispositivo\n");
-      return PTR_ERR(triviaDevice);
-   }
-   printk(KERN_INFO "TriviaLKM: dispositivo creado correcatmente\n"); // inicializado OK!
-   
-   // ahora vamos a reservar recursos de hardware en la funcion de init porque seran de uso exclusivo
-   //
-   // reservar 2 irq para los botones
-   // se deberia chequear con la funcion gpio_is_valid(nro de gpio) a ver si se puede usar cada pin
-   // hay que configurar 6 pines de leds, primera version solo los led rojos
-   
-   // preparamos los leds
-   Rojo1On = false;
-   Rojo2On = false;
-   Verde1On = false;
-   Verde2On = false;
-   Azul1On = false;
-   Azul2On = false;
-   
-   gpio_request(gpioR1, "sysfs");          // le pedimos al sysfs el mapeo del led
-   gpio_request(gpioR2, "sysfs");          // le pedimos al sysfs el mapeo del led
-   gpio_request(gpioV1, "sysfs");          // le pedimos al sysfs el mapeo del led
-   gpio_request(gpioV2, "sysfs");          // le pedimos al sysfs el mapeo del led
-   gpio_request(gpioA1, "sysfs");          // le pedimos al sysfs el mapeo del led
-   gpio_request(gpioA2, "sysfs");          // le pedimos al sysfs el mapeo del led
-   
-   
-   gpio_direction_output(gpioR1, false);   // lo configuramos como salida y estado inicial (off)
-   gpio_direction_output(gpioR2, false);   // lo configuramos como salida y estado inicial (off)
-   gpio_direction_output(gpioV1, false);   // lo configuramos como salida y estado inicial (off)
-   gpio_direction_output(gpioV2, false);   // lo configuramos como salida y estado inicial (off)
-   gpio_direction_output(gpioA1, false);   // lo configuramos como salida y estado inicial (off)
-   gpio_direction_output(gpioA2, false);   // lo configuramos como salida y estado inicial (off)
-   
-   
-// gpio_set_value(gpioR1, false);          // no es necesario ahora, lo pongo por referencia
-
-   gpio_export(gpioR1, false);             // hace gpioXX aparecer en /sys/class/gpio
-   gpio_export(gpioR2, false);             // hace gpioXX aparecer en /sys/class/gpio
-   gpio_export(gpioV1, false);             // hace gpioXX aparecer en /sys/class/gpio
-   gpio_export(gpioV2, false);             // hace gpioXX aparecer en /sys/class/gpio
-   gpio_export(gpioA1, false);             // hace gpioXX aparecer en /sys/class/gpio
-   gpio_export(gpioA2, false);             // hace gpioXX aparecer en /sys/class/gpio
-   
-                     // el argumento bool = false hace que no se pueda cambiar la direccion
-                     
-   gpio_request(gpioBot1, "sysfs");       // lo mismo con los botones ahora
-   gpio_request(gpioBot2, "sysfs");       // lo mismo con los botones ahora
-   
-   gpio_direction_input(gpioBot1);        // los hacemos entrada
-   gpio_direction_input(gpioBot2);        // los hacemos entrada
-   
-   
-   //gpio_set_debounce(gpioButton, 200);      // podriamos debouncearlo pero para esta aplicacion mejor no
-   
-   gpio_export(gpioBot1, false);          // lo hacemos aparecer en  /sys/class/gpio
-   gpio_export(gpioBot2, false);          // lo hacemos aparecer en  /sys/class/gpio
-   
-   // Podriamos verificar el estado de los botones
-   //printk(KERN_INFO "triviaLKM: Estado de boton1: %d\n", gpio_get_value(gpioBot1));
-   //printk(KERN_INFO "triviaLKM: Estado de boton2: %d\n", gpio_get_value(gpioBot2));
-   
-   // como los nros de GPIO e IRQ no son coincidentes, los pedimos con una funcion de mapeo
-   irq1 = gpio_to_irq(gpioBot1);
-   irq2 = gpio_to_irq(gpioBot2);
-   
-   
-   printk(KERN_INFO "triviaLKM: Boton1 en IRQ: %d\n", irq1);
-   printk(KERN_INFO "triviaLKM: Boton2 en IRQ: %d\n", irq2);
- 
-
-  //antes que se habilite el uso de irqs en el handler
-  //preparo el puntero a la tarea que esta usando el driver para hacerla dormir
-  sleeping_task = NULL;	
+   // Register the device driver, uno por mesa con sus atributos de sysfs y la mesa como drvdata
+   for (creados = 0; creados < nMesas; creados++){
+      struct trivia_mesa *m = &tablaMesas[creados];
 
-   
-   // pedimos las IRQ correspondientes - CHEQUEAR ESTO TAMBIEN!!!
-   result = request_irq(irq1,             // la irq pedida
-                        (irq_handler_t) triviaLKM_irq1_handler, // puntero a la funcion handler
-                        IRQF_TRIGGER_RISING,   // flanco de subida
-                        "trivia_gpio_handler",    // en /proc/interrupts para identificar al propietario
-                        NULL);                 // el *dev_id para irqs compartidas, NULL esta OK aqui
- 
-   printk(KERN_INFO "triviaLKM: El pedido de IRQ1 es: %d\n", result);
-
-   result = request_irq(irq2,             // la irq pedida
-                        (irq_handler_t) triviaLKM_irq2_handler, // puntero a la funcion handler
-                        IRQF_TRIGGER_RISING,   // flanco de subida
-                        "trivia_gpio_handler",    // en /proc/interrupts para identificar al propietario
-                        NULL);                 // el *dev_id para irqs compartidas, NULL esta OK aqui
- 
-   printk(KERN_INFO "triviaLKM: El pedido de IRQ2 es: %d\n", result);
-   
+      m->dev = device_create_with_groups(triviaClass, NULL, MKDEV(majorNumber, creados), m, trivia_groups,
+                                         DEVICE_NAME "%d", creados);
+      if (IS_ERR(m->dev)){                  // chequeo de error y cleanup si falla
+         printk(KERN_ALERT "falla al crear el dispositivo de la mesa %d\n", creados);
+         result = PTR_ERR(m->dev);
+         goto err_dispositivos;
+      }
+   }
+   printk(KERN_INFO "TriviaLKM: %d dispositivos creados correcatmente\n", nMesas); // inicializado OK!
    return 0;
+
+err_dispositivos:
+   while (creados--)
+      device_destroy(triviaClass, MKDEV(majorNumber, creados));
+   class_destroy(triviaClass);
+err_chrdev:
+   unregister_chrdev(majorNumber, DEVICE_NAME);
+err_jugadores:
+   trivia_liberar(nJugadores);             // solo los que se llegaron a preparar
+   nJugadores = 0;
+err_anillos:
+   for (i = 0; i < nMesas; i++)
+      vfree(tablaMesas[i].anillo);          // vfree(NULL) no hace nada
+   return result;
 }
 
-// handlers de las IRQs
-static irq_handler_t triviaLKM_irq1_handler(unsigned int irq, void *dev_id, struct pt_regs *regs){
+// Handlers de las IRQs, los mismos para todos los botones: el dev_id es el descriptor del jugador,
+// y de ahi sale su mesa. Dos mesas no tocan ningun dato en comun, sus IRQs corren en paralelo.
+//
+// La IRQ esta partida en dos. La parte rapida corre en contexto de IRQ con las interrupciones
+// deshabilitadas, y solo hace lo que no se puede postergar sin perder equidad:
+//   - ktime_get_ns() al entrar
+//   - un cmpxchg sobre la palabra de ronda (el arbitraje)
+//   - un cmpxchg para reservar la ranura del anillo y la copia de un registro de 32 bytes
+//   - contadores atomicos
+// sin gpio, sin printk y sin locks; su costo queda medido en irq_max_ns / irq_prom_ns en el sysfs.
+// Los leds (que pueden dormir en expansores I2C/SPI), el log y el despertar del lector van en el
+// hilo de la IRQ. Si entran varias presiones antes de que corra el hilo, corre una sola vez y
+// aplica el ultimo estado, los eventos igual quedaron todos en el anillo.
+
+static irqreturn_t trivia_irq_rapida(int irq, void *dev_id){
+  u64 ahora = ktime_get_ns();   // lo primero es tomar el tiempo, para que la latencia del handler no cuente
+  struct trivia_jugador *j = dev_id;
+  struct trivia_mesa *m = j->mesa;
+  struct trivia_evento ev;
+  int palabra;
+  s64 costo, max;
   
-  //al llegar esta int pongo en Verde1 y le anulo el computo al otro boton
+  trace_trivia_irq(m->nro, j->nro, ahora);
+  //antirrebote: una subida vale solo si el boton estuvo suelto y quieto toda la ventana. La primera de
+  //una rafaga pasa enseguida con su propio tiempo (no se espera a que termine de rebotar, para no
+  //perjudicar a nadie), las que le siguen dentro de la ventana se cuentan y se descartan, y las
+  //bajadas solo marcan la suelta.
+  //antirrebote y rebotes son de este jugador y su IRQ no corre en dos CPUs a la vez, no hace falta atomico
+  switch (trivia_core_rebote(&j->antirrebote, !j->antirrebote.dosFlancos || gpio_get_value(j->gpioBoton), ahora,
+                             (u64)READ_ONCE(j->antirreboteUs) * NSEC_PER_USEC)){
+  case TRIVIA_FLANCO_REBOTE:
+	WRITE_ONCE(j->rebotes, j->rebotes + 1);
+	return IRQ_HANDLED;                // rebote, no despierta al hilo
+  case TRIVIA_FLANCO_SUELTA:
+	return IRQ_HANDLED;
+  }
   
-  if (!Azul1On){ //si no esta en stand by
-   
-    // siempre y cuando el otro no halla llegado antes que yo! (bot1)
-    if (!Verde2On) {
-	Rojo1On = false;
-	Azul1On = false;
-	Verde1On = true;
-	//y le enciendo el rojo!
-	Rojo2On=true;
-      
-	gpio_set_value(gpioR1, Rojo1On);
-	gpio_set_value(gpioR2, Rojo2On); 
-	gpio_set_value(gpioV1, Verde1On);
-	gpio_set_value(gpioV2, Verde2On); 
-	gpio_set_value(gpioA1, Azul1On);
-	gpio_set_value(gpioA2, Azul2On); 
-	
-	// y por ultimo, despierto al usuario haciendo read()
-	// siempre y cuando no sea NULL pointer
-	if ( sleeping_task == NULL) {
-	    //nada
-	}else{
-	    boton = 1;
-	    wake_up_process ( sleeping_task );
-	}
-      }
-    }
-    printk(KERN_INFO "triviaLKM: Interrupcion1! (el estado del boton es %d)\n", gpio_get_value(gpioBot1));
-    numberPresses++;                         // acumulador de cantidad de interrups, es informativo
-    return (irq_handler_t) IRQ_HANDLED;      // le avisa al kernel que la IRQ se vectorizo OK
+  //al llegar esta int trato de reclamar la ronda de mi mesa, si gano el hilo pone en verde al jugador
+  //y rojo al resto; si no esta armada (standby) u otro llego antes que yo el reclamo falla, igual queda el registro
+  palabra = trivia_core_presion(&m->core, j->nro, ahora, &ev);
+  if (palabra) {
+	m->ganador = ev;                   // solo lo escribe el que gano el cmpxchg
+	atomic_set_release(&m->ganadorPalabra, palabra);
+	atomic_set(&m->ledsPendientes, 1);
+	trivia_sesion_programar(m, ahora + READ_ONCE(m->revelarNs));   // en sesion, la ronda siguiente
+  }
+  trace_trivia_arbitraje(m->nro, &ev);
+  trivia_estadistica(j, &ev);
+  trivia_anillo_poner(m, &ev);
+  atomic_inc(&m->numberPresses);           // acumulador de cantidad de interrups, es informativo
+
+  // costo de esta parte, el maximo con cmpxchg porque puede haber IRQs en otras CPUs
+  costo = ktime_get_ns() - ahora;
+  atomic64_add(costo, &m->irqTotalNs);
+  atomic_inc(&m->irqCuenta);
+  max = atomic64_read(&m->irqMaxNs);
+  while (costo > max && !atomic64_try_cmpxchg(&m->irqMaxNs, &max, costo))
+	;
+  return IRQ_WAKE_THREAD;                  // el resto lo hace trivia_irq_hilo
 }
 
-static irq_handler_t triviaLKM_irq2_handler(unsigned int irq, void *dev_id, struct pt_regs *regs){
+static irqreturn_t trivia_irq_hilo(int irq, void *dev_id){
+  struct trivia_jugador *j = dev_id;
+  struct trivia_mesa *m = j->mesa;
+
+  if (atomic_xchg(&m->ledsPendientes, 0))
+	trivia_leds(m);                    // puede dormir, aca esta permitido
   
-  if (!Azul2On){ //si no esta en stand by
-    //inverso al del otro boton
-    if (!Verde1On) {
-	Verde2On = true;
-	Rojo2On = false;
-	Azul2On = false;
-	//y le enciendo el rojo!
-	Rojo1On=true;
-	
-	gpio_set_value(gpioR1, Rojo1On);
-	gpio_set_value(gpioR2, Rojo2On); 
-	gpio_set_value(gpioV1, Verde1On);
-	gpio_set_value(gpioV2, Verde2On); 
-	gpio_set_value(gpioA1, Azul1On);
-	gpio_set_value(gpioA2, Azul2On);
-	
-	// y por ultimo, despierto al usuario haciendo read()
-	// siempre y cuando no sea NULL pointer
-	if (sleeping_task==NULL) {
-	    //nada
-	}else{
-	    boton = 2;
-	    wake_up_process(sleeping_task);
-	}
-    }
-  }
-  printk(KERN_INFO "triviaLKM: Interrupcion2! (el estado del boton es %d)\n", gpio_get_value(gpioBot1));
-  numberPresses++;                         // acumulador de cantidad de interrups, es informativo
-  return (irq_handler_t) IRQ_HANDLED;      // le avisa al kernel que la IRQ se vectorizo OK	
+  // y por ultimo, despierto a los que esperan en read() o poll()
+  trace_trivia_despertar(m->nro, j->nro);
+  wake_up_interruptible(&m->espera);
+  // el seguimiento de cada presion va por los tracepoints, esto solo con dynamic debug
+  pr_debug("triviaLKM: Interrupcion del boton %d de la mesa %d! (el estado del boton es %d)\n", j->nro, m->nro, gpio_get_value_cansleep(j->gpioBoton));
+  return IRQ_HANDLED;                      // le avisa al kernel que la IRQ se vectorizo OK
 }
 
 /** @brief Funcion de remocion del LKM
@@ -288,150 +1253,341 @@ static irq_handler_t triviaLKM_irq2_handler(unsigned int irq, void *dev_id, stru
  *  codigo es utilizado por unj driver built-in (no un LKM) esta funcion no es requerida.
  */
 static void __exit trivia_exit(void){
-		
-		
-   printk(KERN_INFO "triviaLKM:se apretaron los botones %d veces\n", numberPresses);
-   // apago todo
-   gpio_set_value(gpioR1, 0);
-   gpio_set_value(gpioR2, 0);
-   gpio_set_value(gpioV1, 0);
-   gpio_set_value(gpioV2, 0);
-   gpio_set_value(gpioA1, 0);
-   gpio_set_value(gpioA2, 0);
-   
-   gpio_unexport(gpioR1);                  // desconecto del sysfs
-   gpio_unexport(gpioR2);                  // desconecto del sysfs
-   gpio_unexport(gpioV1);                  // desconecto del sysfs
-   gpio_unexport(gpioV2);                  // desconecto del sysfs
-   gpio_unexport(gpioA1);                  // desconecto del sysfs
-   gpio_unexport(gpioA2);                  // desconecto del sysfs
-   gpio_unexport(gpioBot1);               // Unexporto los botones
-   gpio_unexport(gpioBot2);               // Unexporto los botones
-   
-   free_irq(irq1, NULL);               // libero las irq solicitadas
-   free_irq(irq2, NULL);               // libero las irq solicitadas
-   
-   gpio_free(gpioR1);                      // libero leds
-   gpio_free(gpioR2);                      // libero leds
-   gpio_free(gpioV1);                      // libero leds
-   gpio_free(gpioV2);                      // libero leds
-   gpio_free(gpioA1);                      // libero leds
-   gpio_free(gpioA2);                      // libero leds
-   
-   gpio_free(gpioBot1);                   // libero botones
-   gpio_free(gpioBot2);                   // 
-   
-   device_destroy(triviaClass, MKDEV(majorNumber, 0));     // remuevo el objeto de la clase
-   class_unregister(triviaClass);                          // desregisto la clase del dispositivo
+   unsigned int i;
+
+   // al reves que el init: primero los dispositivos, asi nadie mas puede abrir una mesa
+   for (i = 0; i < nMesas; i++)
+      device_destroy(triviaClass, MKDEV(majorNumber, i));   // remuevo el objeto de la clase
    class_destroy(triviaClass);                             // remuevo la clase del dispositivo
    unregister_chrdev(majorNumber, DEVICE_NAME);             // desregistro el nro mayor
+		
+   for (i = 0; i < nMesas; i++){
+      struct trivia_mesa *m = &tablaMesas[i];
+		
+      printk(KERN_INFO "triviaLKM: en la mesa %d se apretaron los botones %d veces\n", i, atomic_read(&m->numberPresses));
+      // sin sesion el hrtimer ya no encola works, y la que quedo pendiente termina antes de liberar los leds
+      trivia_sesion_terminar(m);
+      hrtimer_cancel(&m->plazoTimer);                       // sin archivos abiertos nadie lo vuelve a armar
+      cancel_work_sync(&m->ledsWork);
+      // apago todo de una vez
+      trivia_core_estado(&m->core, TRIVIA_LIBRE);
+      trivia_leds(m);                                       // tambien para la animacion
+      cancel_work_sync(&m->ledsWork);                       // la que pudo encolar la animacion al terminar
+      cancel_work_sync(&m->animWork);
+   }
+   // despues desconecto del sysfs y libero irqs, leds y botones de todas las mesas
+   trivia_liberar(nJugadores);
+   for (i = 0; i < nMesas; i++){
+      hrtimer_cancel(&tablaMesas[i].rearmeTimer);           // por si lo reprogramo una IRQ en vuelo
+      vfree(tablaMesas[i].anillo);                          // ya no hay IRQs ni lectores
+   }
    printk(KERN_INFO "TriviaLKM: dispositivo desinstalado OK!\n");
 }
 
 //Funcion open
 static int dev_open(struct inode *inodep, struct file *filep){
-  //encendemos leds azules, esto prepara para iniciar secuencia de juego
-  //apagamos el resto
-  
-  Rojo1On = false;
-  Azul1On = true;
-  Verde1On = false;
-  Rojo2On = false;
-  Azul2On = true;
-  Verde2On = false;
- 
-  gpio_set_value(gpioR1, Rojo1On);
-  gpio_set_value(gpioR2, Rojo2On); 
-  gpio_set_value(gpioV1, Verde1On);
-  gpio_set_value(gpioV2, Verde2On); 
-  gpio_set_value(gpioA1, Azul1On);
-  gpio_set_value(gpioA2, Azul2On); 
-
-  //preparo el puntero a la tarea que esta usando el driver para hacerla dormir
-  sleeping_task = NULL;	
+  unsigned int nro = iminor(inodep);
+  struct trivia_mesa *m;
+
+  //register_chrdev reserva todos los nros menores, solo existen los de las mesas
+  if (nro >= nMesas)
+     return -ENODEV;
+  m = &tablaMesas[nro];
+  filep->private_data = m;         //de aca en mas cada operacion trabaja sobre su mesa
+
+  //solo la primera apertura prepara la mesa: las demas (un tablero, triviabench, un cat) comparten
+  //el juego en curso y no pueden pisar una ronda armada
+  mutex_lock(&m->sesionLock);
+  if (m->abiertos++ == 0){
+     //encendemos leds azules, esto prepara para iniciar secuencia de juego
+     //apagamos el resto
+     trivia_core_estado(&m->core, TRIVIA_ESPERA);
+     trivia_leds(m);
+  }
+  mutex_unlock(&m->sesionLock);
    
    return 0;
 }
 
 // Llamada por read(), apaga leds azules y habilita el juego
+// Si no quedan eventos sin leer y la ronda no esta armada, la arma y espera al primer boton.
+// Devuelve tantos registros enteros como entren en el buffer, el ganador y todas las demas presiones.
+// Con O_NONBLOCK arma igual pero vuelve enseguida con -EAGAIN, y los eventos se esperan con poll().
+// Con plazo_ms la espera esta acotada: si nadie aprieta a tiempo vuelve el registro TRIVIA_EV_VENCIDA.
 
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
+   struct trivia_mesa *m = filep->private_data;
+   struct trivia_ranura *r;
+   size_t copiados = 0;
+   u64 primero = 0;          // t_ns del primer registro copiado, para la latencia en trivia_copia
+   int ret;
    
-  //apagamos todo
-  Rojo1On = false;
-  Azul1On = false;
-  Verde1On = false;
-  Rojo2On = false;
-  Azul2On = false;
-  Verde2On = false;
-  gpio_set_value(gpioR1, Rojo1On);
-  gpio_set_value(gpioR2, Rojo2On); 
-  gpio_set_value(gpioV1, Verde1On);
-  gpio_set_value(gpioV2, Verde2On); 
-  gpio_set_value(gpioA1, Azul1On);
-  gpio_set_value(gpioA2, Azul2On); 
-  
+  if (len < sizeof(struct trivia_evento))       // al menos un registro entero
+     return -EINVAL;
   
-  sleeping_task = current;		//le indico el proceso que esta usando el driver 
-  set_current_state(TASK_INTERRUPTIBLE);//lo pongo a dormir y que se pueda interrumpir
-  schedule();				//y llamo al scheduler del kernel para que despache otra tarea
-  //sigue por aca al llegar una interrupcion por cualquiera de los dos botones
-  // ya que las rutinas de atencion llaman a la macro wake_up_process()
+  if (mutex_lock_interruptible(&m->lecturaLock))
+     return -ERESTARTSYS;
   
-  sleeping_task = NULL;	// por si llega otra interrupcion  
+  //apagamos todo y armamos la ronda, desde aca el primer boton gana
+  //si ya estaba armada (un read anterior interrumpido por una senal) se sigue esperando la misma
+  //en sesion arma el driver, read() solo espera eventos
+  if (!READ_ONCE(m->sesionActiva) && !trivia_anillo_proxima(m) && RONDA_ESTADO(trivia_core_palabra(&m->core)) != TRIVIA_ARMADA &&
+      trivia_armar_sin_sesion(m, 0, (u64)READ_ONCE(plazo_ms) * NSEC_PER_MSEC) > 0)
+     trivia_leds(m);
   
+  if (filep->f_flags & O_NONBLOCK){
+     ret = trivia_anillo_proxima(m) ? 0 : -EAGAIN;
+  } else {
+     //lo pongo a dormir en la wait queue de la mesa, y que se pueda interrumpir
+     //sigue por aca cuando un handler publica un evento y despierta la cola
+     ret = wait_event_interruptible(m->espera, trivia_anillo_proxima(m) != NULL);
+  }
+  if (ret){
+     mutex_unlock(&m->lecturaLock);
+     return ret;
+  }
  
-  //cargo en el message el identificador del boton apretado
-  sprintf(message,"Boton%d\0",boton);
-  size_of_message = sizeof(message);
-   // copy_to_user tiene el formato ( * to, *from, size) y devuelve 0 si es OK
-   error_count = copy_to_user(buffer, message, size_of_message);
+  //devuelvo en lote los registros binarios: jugador, instante de presion y tiempo de reaccion
+  //cada ranura se libera recien despues de copiarla, si la copia falla el evento queda en el anillo
+  while (copiados + sizeof(r->ev) <= len && (r = trivia_anillo_proxima(m))){
+     // copy_to_user tiene el formato ( * to, *from, size) y devuelve 0 si es OK
+     if (copy_to_user(buffer + copiados, &r->ev, sizeof(r->ev)))
+        break;
+     if (!copiados)
+        primero = r->ev.t_ns;
+     trivia_anillo_soltar(m);
+     copiados += sizeof(r->ev);
+  }
+  mutex_unlock(&m->lecturaLock);
 
-   if (error_count==0){            // si estuvo todo OK
-      printk(KERN_INFO "TriviaLKM: Enviados %d bytes al usuario\n", size_of_message);
-      return (size_of_message);
+   if (copiados){            // si estuvo todo OK
+      trace_trivia_copia(m->nro, copiados, ktime_get_ns() - primero);
+      pr_debug("TriviaLKM: Enviados %zu bytes al usuario\n", copiados);
+      return copiados;
    }
    else {
-      printk(KERN_INFO "TriviaLKM: Falla al enviar %d bytes al usuario\n", error_count);
+      printk_ratelimited(KERN_INFO "TriviaLKM: Falla al enviar eventos al usuario\n");
       return -EFAULT;              // falla, devuelve BAD ADDRESS (i.e. -14)
    }
 }
 
-// Llamada por write()
+// Llamada por poll()/select()/epoll, no arma la ronda: eso lo hace read()
+static __poll_t dev_poll(struct file *filep, poll_table *wait){
+   struct trivia_mesa *m = filep->private_data;
+
+   poll_wait(filep, &m->espera, wait);
+   if (trivia_anillo_proxima(m))
+      return EPOLLIN | EPOLLRDNORM;   // hay eventos para leer
+   return 0;
+}
+
+// Llamada por mmap(), mapea la cabecera y las ranuras del anillo de la mesa (ver struct trivia_anillo)
+// el usuario consume los eventos directamente de la memoria compartida, sin copias ni syscalls
+// Con escritura solo se puede mapear la pagina de la cabecera (para avanzar la cola), las ranuras
+// las escribe solo el kernel.
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma){
+   struct trivia_mesa *m = filep->private_data;
+
+   if (vma->vm_pgoff != 0 || vma_pages(vma) != 1){
+      if (vma->vm_flags & VM_WRITE)
+         return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+      vm_flags_clear(vma, VM_MAYWRITE);     // tampoco despues con mprotect()
+#else
+      vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+   }
+   // remap_vmalloc_range rechaza un mapeo mas grande que el anillo
+   return remap_vmalloc_range(vma, m->anillo, vma->vm_pgoff);
+}
+
+// Llamada por write(), muestra el texto por kern.log (por ejemplo la pregunta en juego)
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
+   struct trivia_mesa *m = filep->private_data;
+   size_t n = min(len, sizeof(m->message) - 1);    // lo que no entra se descarta
 	
-	// aqui se deberia usar copy_from_user
-	
-   sprintf(message, "%s(%d letters)", buffer, len);   // appending received string with its length
-   size_of_message = strlen(message);                 // store the length of the stored message
-   printk(KERN_INFO "TriviaLKM: Recibidos %d chars del usuario\n", len);
+   if (copy_from_user(m->message, buffer, n))
+      return -EFAULT;
+   m->message[n] = '\0';
+   m->size_of_message = n;
+   printk(KERN_INFO "TriviaLKM: mesa %d, recibidos %zu chars del usuario: %s\n", m->nro, len, m->message);
    return len;
 }
 
+/** @brief TRIVIA_IOC_LEDS: escribe el banco con las mascaras del usuario, una sola escritura */
+static int trivia_ioctl_leds(struct trivia_mesa *m, const struct trivia_leds *l){
+   u32 validos = (1u << m->nJugadores) - 1;     // nJugadores <= 16
+
+   if (l->reservado || (l->rojos | l->verdes | l->azules) & ~validos)
+      return -EINVAL;
+   mutex_lock(&m->ledsLock);
+   trivia_leds_escribir(m, trivia_core_leds_manual(&m->core, l->rojos, l->verdes, l->azules), trivia_core_palabra(&m->core));
+   mutex_unlock(&m->ledsLock);
+   return 0;
+}
+
+/** @brief TRIVIA_IOC_ARMAR: arma una ronda con el nro pedido o el siguiente */
+static int trivia_ioctl_armar(struct trivia_mesa *m, struct trivia_armar *a){
+   int ret;
+
+   if (a->reservado[0] || a->reservado[1] || a->ronda > 0xffff)
+      return -EINVAL;
+   if (mutex_lock_interruptible(&m->lecturaLock))
+      return -ERESTARTSYS;
+   ret = trivia_armar_sin_sesion(m, a->ronda, (u64)a->plazo_ms * NSEC_PER_MSEC);
+   if (ret > 0){
+      a->ronda = ret;                          // el que se armo, si se pidio el siguiente
+      trivia_leds(m);
+   }
+   mutex_unlock(&m->lecturaLock);
+   return ret < 0 ? ret : 0;
+}
+
+/** @brief TRIVIA_IOC_RESULTADO: el ganador (o el vencimiento) de la ronda actual, esperando hasta el plazo pedido */
+static int trivia_ioctl_resultado(struct trivia_mesa *m, struct trivia_resultado *r){
+   int palabra = trivia_core_palabra(&m->core);
+   unsigned int nro = RONDA_NRO(palabra);
+   long ret;
+
+   if (r->reservado)
+      return -EINVAL;
+   if (RONDA_ESTADO(palabra) != TRIVIA_ARMADA && !trivia_core_cerrada(palabra))
+      return -ENOENT;                          // no hay ronda en juego
+   if (r->plazo_ms == TRIVIA_SIN_PLAZO){
+      ret = wait_event_interruptible(m->espera, trivia_hay_ganador(m, nro));
+   } else if (r->plazo_ms){
+      ret = wait_event_interruptible_timeout(m->espera, trivia_hay_ganador(m, nro), msecs_to_jiffies(r->plazo_ms));
+      ret = ret > 0 ? 0 : ret == 0 ? -ETIMEDOUT : ret;
+   } else {
+      ret = trivia_hay_ganador(m, nro) ? 0 : -EAGAIN;
+   }
+   if (ret)
+      return ret;
+   // el registro se copia y se confirma que no lo piso el ganador de otra ronda mientras tanto
+   do {
+      palabra = atomic_read_acquire(&m->ganadorPalabra);
+      r->ev = m->ganador;
+      smp_rmb();
+   } while (atomic_read(&m->ganadorPalabra) != palabra);
+   return RONDA_NRO(palabra) == nro ? 0 : -ENOENT;
+}
+
+/** @brief TRIVIA_IOC_SESION: arranca, reconfigura o termina la sesion */
+static int trivia_ioctl_sesion(struct trivia_mesa *m, const struct trivia_sesion *se){
+   if (se->activa > 1 || se->rondas > TRIVIA_MAX_COLA)
+      return -EINVAL;
+   if (mutex_lock_interruptible(&m->sesionLock))
+      return -ERESTARTSYS;
+   if (se->activa){
+      WRITE_ONCE(m->revelarNs, (u64)se->revelar_ms * NSEC_PER_MSEC);
+      WRITE_ONCE(m->plazoSesionNs, (u64)se->plazo_ms * NSEC_PER_MSEC);
+      atomic_set(&m->rondasEnCola, se->rondas);
+      WRITE_ONCE(m->sesionActiva, true);
+      smp_mb();      // o la IRQ del ganador ve la sesion, o trivia_sesion_seguir ve la ronda ganada
+      trivia_sesion_seguir(m);
+   } else {
+      trivia_sesion_terminar(m);
+   }
+   mutex_unlock(&m->sesionLock);
+   return 0;
+}
+
+/** @brief TRIVIA_IOC_ENCOLAR: suma rondas a la cola de la sesion
+ *  Se puede llamar con una ronda en juego, asi la siguiente se arma sola mientras se muestra la respuesta.
+ */
+static int trivia_ioctl_encolar(struct trivia_mesa *m, __u32 *rondas){
+   int cola;
+
+   if (mutex_lock_interruptible(&m->sesionLock))
+      return -ERESTARTSYS;
+   if (!READ_ONCE(m->sesionActiva)){
+      mutex_unlock(&m->sesionLock);
+      return -ENOENT;                          // no hay sesion
+   }
+   // el hrtimer descuenta sin el lock, la suma tiene que ser atomica; el cmpxchg exitoso ordena
+   // igual que el smp_mb() de trivia_ioctl_sesion
+   cola = atomic_read(&m->rondasEnCola);
+   do {
+      if (*rondas > TRIVIA_MAX_COLA - cola){
+         mutex_unlock(&m->sesionLock);
+         return -EOVERFLOW;
+      }
+   } while (!atomic_try_cmpxchg(&m->rondasEnCola, &cola, cola + *rondas));
+   *rondas += cola;
+   trivia_sesion_seguir(m);
+   mutex_unlock(&m->sesionLock);
+   return 0;
+}
+
+// Llamada por ioctl(), interfaz de control binaria (ver trivialkm.h), siempre sobre la mesa del archivo
+// las entradas se copian con copy_from_user y se validan antes de tocar nada
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct trivia_mesa *m = filep->private_data;
+   void __user *uarg = (void __user *)arg;
+   union {
+      struct trivia_armar armar;
+      struct trivia_leds leds;
+      struct trivia_resultado resultado;
+      struct trivia_sesion sesion;
+      struct trivia_animar animar;
+      __u32 rondas;
+   } u;
+   int ret;
+
+   if (_IOC_TYPE(cmd) != TRIVIA_IOC_MAGIC || _IOC_SIZE(cmd) > sizeof(u))
+      return -ENOTTY;
+   if ((_IOC_DIR(cmd) & _IOC_WRITE) && copy_from_user(&u, uarg, _IOC_SIZE(cmd)))
+      return -EFAULT;
+
+   switch (cmd){
+   case TRIVIA_IOC_VERSION:
+      return put_user((u32)TRIVIA_ABI_VERSION, (u32 __user *)uarg);
+   case TRIVIA_IOC_ARMAR:
+      ret = trivia_ioctl_armar(m, &u.armar);
+      break;
+   case TRIVIA_IOC_LEDS:
+      return trivia_ioctl_leds(m, &u.leds);
+   case TRIVIA_IOC_RESULTADO:
+      ret = trivia_ioctl_resultado(m, &u.resultado);
+      break;
+   case TRIVIA_IOC_RESET:
+      trivia_reset_contadores(m);
+      return 0;
+   case TRIVIA_IOC_SESION:
+      return trivia_ioctl_sesion(m, &u.sesion);
+   case TRIVIA_IOC_ENCOLAR:
+      ret = trivia_ioctl_encolar(m, &u.rondas);
+      break;
+   case TRIVIA_IOC_ANIMAR:
+      return trivia_animar(m, &u.animar);
+   default:
+      return -ENOTTY;
+   }
+   if (ret == 0 && copy_to_user(uarg, &u, _IOC_SIZE(cmd)))   // ARMAR, RESULTADO y ENCOLAR devuelven datos
+      return -EFAULT;
+   return ret;
+}
+
 
 // la funcion que llama el usuario para "cerrar" el dispositivo
 
 
 static int dev_release(struct inode *inodep, struct file *filep){
+  struct trivia_mesa *m = filep->private_data;
   
-  //apagamos todo
-  Rojo1On = false;
-  Azul1On = false;
-  Verde1On = false;
-  Rojo2On = false;
-  Azul2On = false;
-  Verde2On = false;
-  
-   gpio_set_value(gpioR1, Rojo1On);
-   gpio_set_value(gpioR2, Rojo2On); 
-   gpio_set_value(gpioV1, Verde1On);
-   gpio_set_value(gpioV2, Verde2On); 
-   gpio_set_value(gpioA1, Azul1On);
-   gpio_set_value(gpioA2, Azul2On); 
+  //con el ultimo cierre terminamos la sesion de la mesa, si habia, y apagamos todo
+  mutex_lock(&m->sesionLock);
+  if (--m->abiertos > 0){
+     mutex_unlock(&m->sesionLock);
+     return 0;                     //queda alguien jugando
+  }
+  trivia_sesion_terminar(m);
+  trivia_core_estado(&m->core, TRIVIA_LIBRE);
+  trivia_leds(m);
+  mutex_unlock(&m->sesionLock);
 
 
-  printk(KERN_INFO "TriviaLKM: Dispositivo cerrado correcatmente\n");
+  printk(KERN_INFO "TriviaLKM: Dispositivo de la mesa %d cerrado correcatmente\n", m->nro);
   return 0;
 }
 
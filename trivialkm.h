@@ -0,0 +1,176 @@
+/**
+ * @file   trivialkm.h
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Interfaz binaria entre el driver trivialkm y los programas de usuario
+ * se incluye tanto desde el LKM como desde trivia.c, por eso solo usa tipos de linux/types.h
+ * @see repo del curso en GIT
+ */
+
+#ifndef TRIVIALKM_H
+#define TRIVIALKM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define TRIVIA_ABI_VERSION  2            ///< version del formato de los registros, cambia si cambia el layout
+
+// tipos de registro
+#define TRIVIA_EV_GANADOR   1            ///< el primer boton de la ronda
+#define TRIVIA_EV_PRESION   2            ///< cualquier otra presion: segundos puestos, tardias o anticipadas
+#define TRIVIA_EV_ARMADA    3            ///< la sesion armo una ronda (jugador 0, t_ns = instante de armado)
+#define TRIVIA_EV_VENCIDA   4            ///< nadie apreto antes del plazo (jugador 0, t_ns = vencimiento, delta_ns = plazo cumplido)
+
+// flags del registro
+#define TRIVIA_EVF_ANTICIPADA 0x0001     ///< se apreto con la ronda sin armar (standby)
+#define TRIVIA_EVF_TARDIA     0x0002     ///< se apreto despues de que otro gano la ronda
+
+/** @brief Registro de cada presion, read() sobre /dev/trivialkmN devuelve uno o mas seguidos
+ *  Tamanio fijo y sin punteros para que el usuario lo lea sin parsear strings.
+ *  Los tiempos son CLOCK_MONOTONIC en nanosegundos (ktime_get_ns() en el kernel,
+ *  clock_gettime(CLOCK_MONOTONIC) en espacio de usuario).
+ */
+struct trivia_evento {
+   __u8  version;      ///< TRIVIA_ABI_VERSION con la que se genero el registro
+   __u8  tipo;         ///< TRIVIA_EV_*
+   __u16 largo;        ///< sizeof(struct trivia_evento), permite saltear campos que agreguen versiones nuevas
+   __u32 ronda;        ///< nro de ronda a la que pertenece
+   __u16 jugador;      ///< nro de jugador (boton) dentro de la mesa, a partir de 1
+   __u16 flags;        ///< TRIVIA_EVF_*
+   __u32 reservado;    ///< alineacion de los campos de 64 bits
+   __u64 t_ns;         ///< instante de la presion, tomado al entrar a la IRQ
+   __u64 delta_ns;     ///< tiempo de reaccion: presion menos instante de armado de la ronda (0 si anticipada)
+};
+
+/** @brief Cabecera del anillo de eventos, al principio del area que devuelve mmap()
+ *  Cada mesa tiene el suyo. La cabecera ocupa la primera pagina y detras van las ranuras. El kernel
+ *  produce desde las IRQs de cualquier CPU y publica cada ranura con su nro de secuencia; un unico
+ *  consumidor (read() o quien haya hecho el mmap, no los dos a la vez) avanza la cola.
+ *  La cabecera es lo unico que se puede mapear con escritura, y lo unico que el kernel lee de ella es
+ *  la cola: la capacidad que usa es la suya. Las ranuras se mapean solo lectura.
+ *  El tamanio a mapear es TRIVIA_ANILLO_BYTES(cabecera), con la capacidad del
+ *  parametro del modulo eventos (/sys/module/trivialkm/parameters/eventos).
+ */
+struct trivia_anillo {
+   __u32 version;      ///< TRIVIA_ABI_VERSION
+   __u32 capacidad;    ///< cantidad de ranuras, potencia de 2
+   __u32 cola;         ///< proxima posicion a consumir, la escribe el consumidor
+   __u32 desbordes;    ///< eventos descartados porque el anillo estaba lleno
+   __u32 ranuras;      ///< offset de la primera ranura, el tamanio de pagina
+   __u32 reservado[11];   ///< completa 64 bytes
+};
+
+/** @brief Ranura del anillo
+ *  seq == pos + 1 cuando el evento de la posicion pos esta publicado. Solo la escribe el kernel, la
+ *  ranura vuelve a estar libre cuando la cola pasa de largo.
+ */
+struct trivia_ranura {
+   __u32 seq;          ///< nro de secuencia de la ranura
+   __u32 reservado;
+   struct trivia_evento ev;
+};
+
+#define TRIVIA_RANURAS(a)       ((struct trivia_ranura *)((char *)(a) + (a)->ranuras))
+#define TRIVIA_ANILLO_BYTES(a)  ((a)->ranuras + (size_t)(a)->capacidad * sizeof(struct trivia_ranura))
+
+// Interfaz de control por ioctl: cada operacion es una sola syscall con una estructura de
+// tamanio fijo. Los campos reservados tienen que ir en cero, asi una version nueva puede darles
+// sentido sin cambiar el tamanio (que forma parte del nro de ioctl).
+#define TRIVIA_IOC_MAGIC    't'
+
+/** @brief Armar una ronda (TRIVIA_IOC_ARMAR) */
+struct trivia_armar {
+   __u32 ronda;        ///< entrada: nro de ronda a usar (16 bits, distinto del actual), 0 = el siguiente; salida: el asignado
+   __u32 plazo_ms;     ///< plazo para apretar, 0 = sin plazo; al vencer la ronda cierra con TRIVIA_EV_VENCIDA
+   __u32 reservado[2];
+};
+
+/** @brief Prender leds a mano (TRIVIA_IOC_LEDS), bit i = jugador i+1
+ *  Pisa lo que muestra el juego hasta el proximo cambio de estado de la ronda.
+ */
+struct trivia_leds {
+   __u32 rojos;
+   __u32 verdes;
+   __u32 azules;
+   __u32 reservado;
+};
+
+#define TRIVIA_SIN_PLAZO    0xffffffffu  ///< plazo_ms para esperar sin limite
+
+/** @brief Pedir el ganador de la ronda actual (TRIVIA_IOC_RESULTADO)
+ *  No consume eventos del anillo: el ganador tambien sale por read() y mmap().
+ *  Si la ronda vencio sin ganador, ev es el registro TRIVIA_EV_VENCIDA.
+ */
+struct trivia_resultado {
+   __u32 plazo_ms;     ///< entrada: cuanto esperar si todavia no hay ganador, 0 = no esperar (-EAGAIN)
+   __u32 reservado;
+   struct trivia_evento ev;   ///< salida: el registro TRIVIA_EV_GANADOR o TRIVIA_EV_VENCIDA
+};
+
+/** @brief Modo sesion (TRIVIA_IOC_SESION)
+ *  Con la sesion activa el driver arma solo la ronda siguiente revelar_ms despues de cada ganador,
+ *  mientras queden rondas en la cola; read() y TRIVIA_IOC_ARMAR ya no arman. Cada armado deja un
+ *  registro TRIVIA_EV_ARMADA en el anillo, asi el usuario sabe cuando mostrar la pregunta.
+ */
+struct trivia_sesion {
+   __u32 activa;       ///< 1 arranca (o reconfigura) la sesion, 0 la termina y vacia la cola
+   __u32 revelar_ms;   ///< espera entre el ganador de una ronda y el armado de la siguiente
+   __u32 rondas;       ///< rondas en la cola al arrancar, la primera se arma enseguida
+   __u32 plazo_ms;     ///< plazo de cada ronda de la sesion, 0 = sin plazo
+};
+
+// patrones de TRIVIA_IOC_ANIMAR
+#define TRIVIA_ANIM_NINGUNA   0          ///< para la animacion, los leds vuelven a mostrar el juego
+#define TRIVIA_ANIM_PARPADEO  1          ///< prenden y apagan juntos, medio periodo cada cosa
+#define TRIVIA_ANIM_PULSO     2          ///< el brillo sube y baja una vez por periodo
+#define TRIVIA_ANIM_CARRERA   3          ///< un jugador por vez, recorre la mesa una vez por periodo
+#define TRIVIA_ANIM_GANADOR   4          ///< el verde del ganador de la ronda destella, el resto queda en rojo
+
+/** @brief Animacion de leds a cargo del driver (TRIVIA_IOC_ANIMAR)
+ *  La corre un hrtimer de la mesa, con el brillo por PWM por software, sin pasar por la IRQ de los
+ *  botones. Cualquier cambio de estado del juego (armar, ganador, vencimiento, abrir o cerrar) y
+ *  TRIVIA_IOC_LEDS la paran y los leds vuelven a mostrar el juego.
+ */
+struct trivia_animar {
+   __u32 patron;       ///< TRIVIA_ANIM_*
+   __u32 periodo_ms;   ///< duracion de un ciclo del patron, 0 = 1000 ms
+   __u32 ciclos;       ///< ciclos antes de volver al juego, 0 = hasta que se pare
+   __u32 brillo;       ///< brillo maximo en %, 0 = 100
+   __u32 rojos;        ///< leds que participan, bit i = jugador i+1 como en trivia_leds;
+   __u32 verdes;       ///< los tres en 0 = todos los leds de la mesa, TRIVIA_ANIM_GANADOR los ignora
+   __u32 azules;
+   __u32 reservado;
+};
+
+#define TRIVIA_IOC_VERSION    _IOR(TRIVIA_IOC_MAGIC, 0, __u32)                    ///< devuelve TRIVIA_ABI_VERSION
+#define TRIVIA_IOC_ARMAR      _IOWR(TRIVIA_IOC_MAGIC, 1, struct trivia_armar)     ///< apaga los leds y arma una ronda
+#define TRIVIA_IOC_LEDS       _IOW(TRIVIA_IOC_MAGIC, 2, struct trivia_leds)       ///< escribe el banco de leds
+#define TRIVIA_IOC_RESULTADO  _IOWR(TRIVIA_IOC_MAGIC, 3, struct trivia_resultado) ///< ganador, esperando hasta plazo_ms
+#define TRIVIA_IOC_RESET      _IO(TRIVIA_IOC_MAGIC, 4)                            ///< pone en cero contadores y estadisticas
+#define TRIVIA_IOC_SESION     _IOW(TRIVIA_IOC_MAGIC, 5, struct trivia_sesion)     ///< arranca o termina la sesion
+#define TRIVIA_IOC_ENCOLAR    _IOWR(TRIVIA_IOC_MAGIC, 6, __u32)                   ///< suma rondas a la cola, devuelve las pendientes
+#define TRIVIA_IOC_ANIMAR     _IOW(TRIVIA_IOC_MAGIC, 7, struct trivia_animar)     ///< arranca o para una animacion de leds
+
+#ifndef __KERNEL__
+/** @brief Mira el proximo evento del anillo mapeado, sin copiarlo ni hacer syscalls
+ *  @return puntero al evento dentro del anillo, o NULL si esta vacio
+ */
+static inline const struct trivia_evento *trivia_anillo_mirar(struct trivia_anillo *a){
+   __u32 cola = a->cola;
+   struct trivia_ranura *r = &TRIVIA_RANURAS(a)[cola & (a->capacidad - 1)];
+
+   if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != cola + 1)
+      return NULL;
+   return &r->ev;
+}
+
+/** @brief Libera el evento que devolvio trivia_anillo_mirar() para que el kernel reuse la ranura
+ *  Avanza la cola, que es lo unico que escribe el consumidor.
+ */
+static inline void trivia_anillo_soltar(struct trivia_anillo *a){
+   __atomic_store_n(&a->cola, a->cola + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+#endif
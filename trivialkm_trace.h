@@ -0,0 +1,124 @@
+/**
+ * @file   trivialkm_trace.h
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   Tracepoints del driver trivialkm
+ * cada presion se puede seguir desde la IRQ hasta que el registro llega al usuario, con ftrace
+ * (/sys/kernel/tracing/events/trivialkm/) o perf, sin printk en el camino caliente:
+ *   trivia_irq -> trivia_arbitraje -> trivia_leds / trivia_despertar -> trivia_copia
+ * trivia_copia trae la latencia de punta a punta (desde la IRQ hasta el fin del copy_to_user)
+ * todos llevan la mesa (el nro menor de /dev/trivialkmN), los nros de jugador son dentro de la mesa
+ * @see repo del curso en GIT
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM trivialkm
+
+#if !defined(TRIVIALKM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define TRIVIALKM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/** @brief Entrada a la parte rapida de la IRQ de un boton, antes del antirrebote */
+TRACE_EVENT(trivia_irq,
+   TP_PROTO(unsigned int mesa, unsigned int jugador, u64 t_ns),
+   TP_ARGS(mesa, jugador, t_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, mesa)
+      __field(unsigned int, jugador)
+      __field(u64, t_ns)
+   ),
+   TP_fast_assign(
+      __entry->mesa    = mesa;
+      __entry->jugador = jugador;
+      __entry->t_ns    = t_ns;
+   ),
+   TP_printk("mesa=%u jugador=%u t_ns=%llu", __entry->mesa, __entry->jugador, __entry->t_ns)
+);
+
+/** @brief Resultado del arbitraje: el registro que queda en el anillo (ganador, tardia o anticipada) */
+TRACE_EVENT(trivia_arbitraje,
+   TP_PROTO(unsigned int mesa, const struct trivia_evento *ev),
+   TP_ARGS(mesa, ev),
+   TP_STRUCT__entry(
+      __field(unsigned int, mesa)
+      __field(u32, ronda)
+      __field(u16, jugador)
+      __field(u8, tipo)
+      __field(u16, flags)
+      __field(u64, delta_ns)
+   ),
+   TP_fast_assign(
+      __entry->mesa     = mesa;
+      __entry->ronda    = ev->ronda;
+      __entry->jugador  = ev->jugador;
+      __entry->tipo     = ev->tipo;
+      __entry->flags    = ev->flags;
+      __entry->delta_ns = ev->delta_ns;
+   ),
+   TP_printk("mesa=%u ronda=%u jugador=%u tipo=%u flags=%#x delta_ns=%llu", __entry->mesa, __entry->ronda, __entry->jugador,
+             __entry->tipo, __entry->flags, __entry->delta_ns)
+);
+
+/** @brief Escritura del banco de leds terminada, valores es la mascara de nbits leds en orden LED() */
+TRACE_EVENT(trivia_leds,
+   TP_PROTO(unsigned int mesa, const unsigned long *valores, unsigned int nbits, unsigned int ronda, unsigned int estado),
+   TP_ARGS(mesa, valores, nbits, ronda, estado),
+   TP_STRUCT__entry(
+      __field(unsigned int, mesa)
+      __bitmask(valores, nbits)
+      __field(unsigned int, ronda)
+      __field(unsigned int, estado)
+   ),
+   TP_fast_assign(
+      __entry->mesa    = mesa;
+      __assign_bitmask(valores, valores, nbits);
+      __entry->ronda   = ronda;
+      __entry->estado  = estado;
+   ),
+   TP_printk("mesa=%u ronda=%u estado=%u valores=%s", __entry->mesa, __entry->ronda, __entry->estado, __get_bitmask(valores))
+);
+
+/** @brief Se despierta a los lectores (read, poll, TRIVIA_IOC_RESULTADO), jugador 0 si lo hizo un hrtimer */
+TRACE_EVENT(trivia_despertar,
+   TP_PROTO(unsigned int mesa, unsigned int jugador),
+   TP_ARGS(mesa, jugador),
+   TP_STRUCT__entry(
+      __field(unsigned int, mesa)
+      __field(unsigned int, jugador)
+   ),
+   TP_fast_assign(
+      __entry->mesa    = mesa;
+      __entry->jugador = jugador;
+   ),
+   TP_printk("mesa=%u jugador=%u", __entry->mesa, __entry->jugador)
+);
+
+/** @brief read() termino de copiar registros al usuario
+ *  lat_ns es desde el t_ns del primer registro copiado (tomado al entrar a su IRQ) hasta aca.
+ */
+TRACE_EVENT(trivia_copia,
+   TP_PROTO(unsigned int mesa, size_t bytes, u64 lat_ns),
+   TP_ARGS(mesa, bytes, lat_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, mesa)
+      __field(size_t, bytes)
+      __field(u64, lat_ns)
+   ),
+   TP_fast_assign(
+      __entry->mesa   = mesa;
+      __entry->bytes  = bytes;
+      __entry->lat_ns = lat_ns;
+   ),
+   TP_printk("mesa=%u bytes=%zu lat_ns=%llu", __entry->mesa, __entry->bytes, __entry->lat_ns)
+);
+
+#endif
+
+// el header se vuelve a incluir desde define_trace.h, que lo busca junto al fuente del modulo
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trivialkm_trace
+#include <trace/define_trace.h>
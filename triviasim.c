@@ -0,0 +1,399 @@
+/**
+ * @file   triviasim.c
+ * @author Juan A. Montenegro
+ * @date   26 Oct 2016
+ * @version 0.1
+ * @brief   El nucleo del juego (trivia_core.h) en espacio de usuario, con reloj y leds de mentira
+ * sirve para probar las reglas del juego y medirlas sin BeagleBone ni modulo cargado:
+ *   fuzz:  operaciones al azar (armar, flancos de los botones, vencer, abrir, cerrar) comparadas contra un
+ *          modelo simple
+ *   bench: presiones por segundo del arbitraje mas el calculo de los leds
+ *   hilos: varios hilos apretando la misma ronda a la vez, tiene que ganar uno solo; y una presion
+ *          frenada a mano entre la lectura de la ronda y el cmpxchg mientras se arma la siguiente
+ *   estres: muchos hilos apretando sin parar mientras otro re-arma rondas, a veces antes de que
+ *           alguien gane; cada ronda tiene a lo sumo un ganador y ninguna presion gana una ronda
+ *           armada despues de ella; los hilos ceden la CPU al azar dentro del arbitraje, asi los
+ *           cortes entre la lectura y el cmpxchg aparecen aunque haya una sola CPU
+ * uso: triviasim [fuzz|bench|hilos|estres] [cantidad] [semilla o hilos]
+ * @see repo del curso en GIT
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<pthread.h>
+#include<sched.h>
+#include<semaphore.h>
+
+// Pausas dentro del nucleo: un hilo se puede frenar en un punto fijo hasta que lo suelten (para
+// armar a mano un intercalado entre una presion y un armado), y en estres se cede la CPU al azar
+// en esos puntos, asi los intercalados aparecen aunque haya una sola CPU
+struct pausa {
+  int punto;               ///< TRIVIA_PAUSA_* donde frenar
+  sem_t llego;             ///< el hilo llego al punto
+  sem_t sigue;             ///< el hilo puede seguir
+};
+static __thread struct pausa *pausaHilo;
+static __thread unsigned int azarHilo;
+static int cederAlAzar;
+
+static void pausar(int punto){
+  if (pausaHilo && pausaHilo->punto == punto){
+    sem_post(&pausaHilo->llego);
+    sem_wait(&pausaHilo->sigue);
+  } else if (cederAlAzar && rand_r(&azarHilo) % 4 == 0){
+    sched_yield();
+  }
+}
+#define TRIVIA_CORE_PAUSA(punto) pausar(punto)
+
+#include "trivia_core.h"   // el mismo fuente que compila el LKM
+
+#define JUGADORES 8
+#define VENTANA   5000     // antirrebote de la simulacion, en ns del reloj de mentira
+
+static unsigned long long ahora_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief Leds esperados para un estado, recorriendo jugadores (sin las mascaras del nucleo) */
+static __u64 leds_modelo(unsigned int estado, unsigned int ganador){
+  __u64 m = 0;
+  unsigned int j;
+
+  for (j = 1; j <= JUGADORES; j++){
+    if (estado == TRIVIA_ESPERA)
+      m |= 1ULL << LED(j, LED_AZUL);
+    else if (estado == TRIVIA_VENCIDA || (estado == TRIVIA_GANADA && j != ganador))
+      m |= 1ULL << LED(j, LED_ROJO);
+    else if (estado == TRIVIA_GANADA)
+      m |= 1ULL << LED(j, LED_VERDE);
+  }
+  return m;
+}
+
+/** @brief Operaciones al azar contra un modelo que lleva el estado en variables sueltas
+ *  @return cantidad de discrepancias
+ */
+static unsigned int fuzz(unsigned long pasos, unsigned int semilla){
+  struct trivia_core core;
+  struct trivia_evento ev;
+  struct trivia_antirrebote antirrebote[JUGADORES + 1];
+  unsigned int estado = TRIVIA_LIBRE, nro = 0, ganador = 0, errores = 0, j, op;
+  unsigned long long reloj = 1, tArmado = 0, tVence = TRIVIA_NUNCA, ultimo[JUGADORES + 1] = { 0 };
+  int alto[JUGADORES + 1] = { 0 }, suelto[JUGADORES + 1];
+  unsigned long i;
+  int palabra, flanco, esperado;
+
+  srand(semilla);
+  trivia_core_iniciar(&core, JUGADORES);
+  // los impares con los dos flancos, los pares solo con las subidas (como en un chip que duerme)
+  for (j = 1; j <= JUGADORES; j++){
+    trivia_core_antirrebote_iniciar(&antirrebote[j], j % 2);
+    suelto[j] = 1;
+  }
+  for (i = 0; i < pasos; i++){
+    reloj += rand() % 10000;             // el reloj de mentira solo avanza
+    op = rand() % 10;
+    if (op == 0){                        // armar, con o sin plazo
+      unsigned long long plazo = rand() % 2 ? rand() % 50000 + 1 : 0;
+
+      nro = trivia_core_siguiente(nro);
+      trivia_core_armar(&core, nro, reloj, plazo);
+      estado = TRIVIA_ARMADA;
+      ganador = 0;
+      tArmado = reloj;
+      tVence = plazo ? reloj + plazo : TRIVIA_NUNCA;
+    } else if (op == 1){                 // abrir o cerrar
+      estado = rand() % 2 ? TRIVIA_ESPERA : TRIVIA_LIBRE;
+      ganador = 0;
+      trivia_core_estado(&core, estado);
+    } else if (op == 2){                 // el hrtimer del plazo
+      palabra = trivia_core_vencer(&core, reloj, &ev);
+      if (estado == TRIVIA_ARMADA && reloj >= tVence){
+        estado = TRIVIA_VENCIDA;
+        errores += !palabra || ev.tipo != TRIVIA_EV_VENCIDA || ev.ronda != nro || ev.delta_ns != reloj - tArmado;
+      } else {
+        errores += palabra != 0;
+      }
+    } else {                             // un flanco del boton de cualquier jugador
+      j = rand() % JUGADORES + 1;
+      // con los dos flancos la linea alterna, salvo alguna bajada que se pierde; la subida vale si
+      // hubo bajada desde la ultima presion y ningun flanco en la ventana
+      alto[j] = j % 2 == 0 || !alto[j] || rand() % 8 == 0;
+      if (j % 2 == 0)
+        esperado = reloj - ultimo[j] >= VENTANA ? TRIVIA_FLANCO_PRESION : TRIVIA_FLANCO_REBOTE;
+      else if (!alto[j])
+        esperado = TRIVIA_FLANCO_SUELTA;
+      else
+        esperado = suelto[j] && reloj - ultimo[j] >= VENTANA ? TRIVIA_FLANCO_PRESION : TRIVIA_FLANCO_REBOTE;
+      if (j % 2)
+        suelto[j] = esperado == TRIVIA_FLANCO_SUELTA || (suelto[j] && esperado != TRIVIA_FLANCO_PRESION);
+      ultimo[j] = reloj;
+      flanco = trivia_core_rebote(&antirrebote[j], alto[j], reloj, VENTANA);
+      if (flanco != esperado){
+        if (!errores)
+          fprintf(stderr, "fuzz: antirrebote del jugador %u en el paso %lu\n", j, i);
+        errores++;
+        continue;
+      }
+      if (flanco != TRIVIA_FLANCO_PRESION)
+        continue;
+      palabra = trivia_core_presion(&core, j, reloj, &ev);
+      if (estado == TRIVIA_ARMADA){
+        estado = TRIVIA_GANADA;
+        ganador = j;
+        errores += !palabra || ev.tipo != TRIVIA_EV_GANADOR || ev.delta_ns != reloj - tArmado;
+      } else {
+        errores += palabra != 0 || ev.tipo != TRIVIA_EV_PRESION ||
+                   ev.flags != (estado == TRIVIA_GANADA || estado == TRIVIA_VENCIDA ? TRIVIA_EVF_TARDIA : TRIVIA_EVF_ANTICIPADA);
+      }
+      errores += ev.jugador != j || ev.ronda != nro || ev.t_ns != reloj;
+    }
+    palabra = trivia_core_palabra(&core);
+    if (RONDA_PALABRA(nro, ganador, estado) != palabra || trivia_core_leds(&core, palabra) != leds_modelo(estado, ganador)){
+      if (!errores)
+        fprintf(stderr, "fuzz: primera discrepancia en el paso %lu (semilla %u)\n", i, semilla);
+      errores++;
+    }
+  }
+  printf("fuzz: %lu pasos, semilla %u, %u discrepancias\n", pasos, semilla, errores);
+  return errores;
+}
+
+/** @brief Presiones por segundo: rondas de JUGADORES presiones (un ganador y el resto tardias) */
+static void bench(unsigned long presiones){
+  struct trivia_core core;
+  struct trivia_evento ev;
+  unsigned long long t0, t, reloj = 0;
+  unsigned long i, ganadas = 0;
+  volatile __u64 leds = 0;            // que el compilador no descarte el calculo
+  unsigned int nro = 0;
+  int palabra;
+
+  trivia_core_iniciar(&core, JUGADORES);
+  t0 = ahora_ns();
+  for (i = 0; i < presiones; i++){
+    if (i % JUGADORES == 0)
+      trivia_core_armar(&core, nro = trivia_core_siguiente(nro), reloj, 0);
+    palabra = trivia_core_presion(&core, i % JUGADORES + 1, ++reloj, &ev);
+    if (palabra){
+      ganadas++;
+      leds = trivia_core_leds(&core, palabra);
+    }
+  }
+  t = ahora_ns() - t0;
+  printf("bench: %lu presiones, %lu rondas, %.1f ns por presion, %.0f presiones/s\n",
+         presiones, ganadas, (double)t / presiones, presiones * 1e9 / t);
+  (void)leds;
+}
+
+// hilos: todos esperan en la barrera a que se arme la ronda y aprietan a la vez
+static struct trivia_core coreHilos;
+static pthread_barrier_t barrera;
+static unsigned long rondasHilos;
+static int ganoHilo[JUGADORES + 1];
+
+static void *hilo(void *arg){
+  unsigned int j = (unsigned long)arg;
+  struct trivia_evento ev;
+  unsigned long r;
+
+  for (r = 0; r < rondasHilos; r++){
+    pthread_barrier_wait(&barrera);      // ronda armada
+    ganoHilo[j] = trivia_core_presion(&coreHilos, j, r, &ev) != 0;
+    pthread_barrier_wait(&barrera);      // todos apretaron
+  }
+  return NULL;
+}
+
+// intercalado: una presion frenada despues de leer la ronda armada y un armado frenado antes de publicar
+static struct trivia_core coreIntercalado;
+static struct pausa pausaPresion, pausaArmado;
+static struct trivia_evento evIntercalado;
+static int palabraIntercalado;
+
+static void *hilo_presion(void *arg){
+  pausaHilo = &pausaPresion;
+  palabraIntercalado = trivia_core_presion(&coreIntercalado, 1, (unsigned long)arg, &evIntercalado);
+  return NULL;
+}
+
+static void *hilo_armado(void *arg){
+  pausaHilo = &pausaArmado;
+  trivia_core_armar(&coreIntercalado, (unsigned long)arg, 200, 0);
+  return NULL;
+}
+
+/** @brief Una presion que leyo la ronda 1 armada y sigue recien cuando la ronda 2 ya tiene sus tiempos
+ *  escritos pero todavia no se publico. No puede ganar la 1 (y menos con el tArmado de la 2), y la
+ *  palabra queda en la 2 armada.
+ *  @param armadoPrimero si el armado termina antes de que siga la presion, o si la presion termina
+ *  mientras el armado esta frenado
+ *  @return cantidad de errores
+ */
+static unsigned int intercalado(int armadoPrimero){
+  pthread_t p, a;
+  unsigned int errores = 0;
+
+  trivia_core_iniciar(&coreIntercalado, 2);
+  trivia_core_armar(&coreIntercalado, 1, 100, 0);
+  pausaPresion.punto = TRIVIA_PAUSA_RECLAMAR;
+  pausaArmado.punto = TRIVIA_PAUSA_ARMAR;
+  sem_init(&pausaPresion.llego, 0, 0);
+  sem_init(&pausaPresion.sigue, 0, 0);
+  sem_init(&pausaArmado.llego, 0, 0);
+  sem_init(&pausaArmado.sigue, 0, 0);
+  pthread_create(&p, NULL, hilo_presion, (void *)250UL);   // apreto en 250, despues del armado de la 2 (200)
+  sem_wait(&pausaPresion.llego);                          // vio la ronda 1 armada
+  pthread_create(&a, NULL, hilo_armado, (void *)2UL);
+  sem_wait(&pausaArmado.llego);                           // la 2 tiene sus tiempos, sin publicar
+  if (armadoPrimero){
+    sem_post(&pausaArmado.sigue);
+    pthread_join(a, NULL);
+    sem_post(&pausaPresion.sigue);
+    pthread_join(p, NULL);
+  } else {
+    sem_post(&pausaPresion.sigue);
+    pthread_join(p, NULL);
+    sem_post(&pausaArmado.sigue);
+    pthread_join(a, NULL);
+  }
+  errores += palabraIntercalado != 0 || evIntercalado.tipo != TRIVIA_EV_PRESION ||
+             evIntercalado.flags != TRIVIA_EVF_ANTICIPADA;
+  errores += trivia_core_palabra(&coreIntercalado) != RONDA_PALABRA(2, 0, TRIVIA_ARMADA);
+  sem_destroy(&pausaPresion.llego);
+  sem_destroy(&pausaPresion.sigue);
+  sem_destroy(&pausaArmado.llego);
+  sem_destroy(&pausaArmado.sigue);
+  return errores;
+}
+
+static unsigned int hilos(unsigned long rondas, unsigned int n){
+  pthread_t h[JUGADORES + 1];
+  unsigned int j, ganadores, errores = 0, nro = 0;
+  unsigned long r;
+
+  if (n < 2 || n > JUGADORES)
+    n = JUGADORES;
+  rondasHilos = rondas;
+  trivia_core_iniciar(&coreHilos, n);
+  pthread_barrier_init(&barrera, NULL, n + 1);
+  for (j = 1; j <= n; j++)
+    pthread_create(&h[j], NULL, hilo, (void *)(unsigned long)j);
+  for (r = 0; r < rondas; r++){
+    trivia_core_armar(&coreHilos, nro = trivia_core_siguiente(nro), r, 0);
+    pthread_barrier_wait(&barrera);
+    pthread_barrier_wait(&barrera);
+    for (ganadores = 0, j = 1; j <= n; j++)
+      ganadores += ganoHilo[j];
+    // uno solo, y el mismo que quedo en la palabra de la ronda
+    errores += ganadores != 1 || !ganoHilo[RONDA_JUGADOR(trivia_core_palabra(&coreHilos))];
+  }
+  for (j = 1; j <= n; j++)
+    pthread_join(h[j], NULL);
+  printf("hilos: %lu rondas con %u hilos, %u rondas sin un unico ganador\n", rondas, n, errores);
+  j = intercalado(0) + intercalado(1);
+  printf("hilos: presion frenada entre dos armados, %u errores\n", j);
+  return errores + j;
+}
+
+// estres: el reloj es un contador compartido, cada presion y cada armado toman un instante distinto
+#define RONDAS_ESTRES 0xffff   // cada nro de ronda se usa una sola vez
+static struct trivia_core coreEstres;
+static unsigned long long relojEstres;
+static unsigned long long tArmadoDe[RONDAS_ESTRES + 1];   ///< instante de armado de cada nro de ronda
+static unsigned int ganadasDe[RONDAS_ESTRES + 1];         ///< ganadores de cada nro de ronda
+static unsigned int erroresEstres;
+static int finEstres;
+
+static void *hilo_estres(void *arg){
+  unsigned int j = (unsigned long)arg;
+  struct trivia_evento ev;
+  unsigned long long ahora;
+  unsigned int nro;
+  int palabra;
+
+  azarHilo = j;
+  while (!__atomic_load_n(&finEstres, __ATOMIC_RELAXED)){
+    ahora = __atomic_add_fetch(&relojEstres, 1, __ATOMIC_SEQ_CST);   // la IRQ toma el tiempo al entrar
+    palabra = trivia_core_presion(&coreEstres, j, ahora, &ev);
+    if (palabra){
+      nro = RONDA_NRO(palabra);
+      __atomic_add_fetch(&ganadasDe[nro], 1, __ATOMIC_RELAXED);
+      // la presion es posterior al armado de la ronda que gano y la reaccion sale de ese armado
+      if (ahora < __atomic_load_n(&tArmadoDe[nro], __ATOMIC_RELAXED) || ev.ronda != nro ||
+          ev.delta_ns != ahora - __atomic_load_n(&tArmadoDe[nro], __ATOMIC_RELAXED))
+        __atomic_add_fetch(&erroresEstres, 1, __ATOMIC_RELAXED);
+    } else if (ev.delta_ns > ahora){                  // delta de una tardia que dio la vuelta
+      __atomic_add_fetch(&erroresEstres, 1, __ATOMIC_RELAXED);
+    }
+    if (RONDA_ESTADO(trivia_core_palabra(&coreEstres)) != TRIVIA_ARMADA)
+      sched_yield();                     // ronda cerrada: que el armador siga aunque haya una sola CPU
+  }
+  return NULL;
+}
+
+static unsigned int estres(unsigned long rondas, unsigned int n){
+  pthread_t h[JUGADORES + 1];
+  unsigned int j, nro = 0, ganadas = 0, repetidas = 0;
+  unsigned long r, espera;
+  volatile unsigned long giro;
+  unsigned long long t;
+
+  if (n < 2 || n > JUGADORES)
+    n = JUGADORES;
+  if (rondas > RONDAS_ESTRES)
+    rondas = RONDAS_ESTRES;
+  trivia_core_iniciar(&coreEstres, n);
+  cederAlAzar = 1;                       // presiones y armados se cortan entre la lectura y el cmpxchg
+  for (j = 1; j <= n; j++)
+    pthread_create(&h[j], NULL, hilo_estres, (void *)(unsigned long)j);
+  srand(n);
+  for (r = 0; r < rondas; r++){
+    nro = trivia_core_siguiente(nro);
+    t = __atomic_add_fetch(&relojEstres, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&tArmadoDe[nro], t, __ATOMIC_RELAXED);   // antes de publicar la ronda
+    trivia_core_armar(&coreEstres, nro, t, 0);
+    if (rand() % 2){                     // la mitad se re-arma enseguida, antes de que alguien gane
+      for (espera = rand() % 2000, giro = 0; giro < espera; giro++)
+        ;
+    } else {                             // y la otra mitad espera al ganador
+      while (RONDA_ESTADO(trivia_core_palabra(&coreEstres)) == TRIVIA_ARMADA)
+        sched_yield();
+    }
+  }
+  __atomic_store_n(&finEstres, 1, __ATOMIC_RELAXED);
+  for (j = 1; j <= n; j++)
+    pthread_join(h[j], NULL);
+  for (nro = 1; nro <= RONDAS_ESTRES; nro++){
+    ganadas += ganadasDe[nro] != 0;
+    repetidas += ganadasDe[nro] > 1;
+  }
+  printf("estres: %lu rondas con %u hilos, %u ganadas, %u con mas de un ganador, %u presiones mal arbitradas\n",
+         rondas, n, ganadas, repetidas, erroresEstres);
+  return repetidas + erroresEstres;
+}
+
+int main(int argc, char *argv[]){
+  const char *modo = argc > 1 ? argv[1] : "fuzz";
+  unsigned long cantidad = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  unsigned int extra = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+
+  if (strcmp(modo, "fuzz") == 0)
+    return fuzz(cantidad, extra ? extra : (unsigned int)time(NULL)) ? EXIT_FAILURE : 0;
+  if (strcmp(modo, "bench") == 0){
+    bench(cantidad);
+    return 0;
+  }
+  if (strcmp(modo, "hilos") == 0)
+    return hilos(cantidad, extra) ? EXIT_FAILURE : 0;
+  if (strcmp(modo, "estres") == 0)
+    return estres(cantidad, extra) ? EXIT_FAILURE : 0;
+  fprintf(stderr, "uso: %s [fuzz|bench|hilos|estres] [cantidad] [semilla o hilos]\n", argv[0]);
+  return EXIT_FAILURE;
+}